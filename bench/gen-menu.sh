@@ -0,0 +1,37 @@
+#!/bin/sh
+# SPDX-License-Identifier: GPL-2.0-only
+#
+# Write a menu file with <nr-items> items to stdout, in submenus of 100 items
+# which the root menu refers to, for benchmarking the parser
+#
+# usage: gen-menu.sh [nr-items]
+
+nr_items=${1:-30000}
+
+awk -v nr_items="$nr_items" 'BEGIN {
+	per_menu = 100
+	nr_menus = int((nr_items + per_menu - 1) / per_menu)
+	print "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
+	print "<openbox_menu>"
+	for (m = 0; m < nr_menus; m++) {
+		printf "<menu id=\"menu-%d\" label=\"Menu %d\">\n", m, m
+		for (i = 0; i < per_menu && m * per_menu + i < nr_items; i++) {
+			if (i && i % 10 == 0) {
+				print "  <separator />"
+			}
+			printf "  <item label=\"Item %d of menu %d\">\n", i, m
+			print "    <action name=\"Execute\">"
+			printf "      <command>sh -c \"echo %d\"</command>\n", \
+				m * per_menu + i
+			print "    </action>"
+			print "  </item>"
+		}
+		print "</menu>"
+	}
+	print "<menu id=\"root-menu\" label=\"Root\">"
+	for (m = 0; m < nr_menus; m++) {
+		printf "  <menu id=\"menu-%d\" />\n", m
+	}
+	print "</menu>"
+	print "</openbox_menu>"
+}'
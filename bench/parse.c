@@ -0,0 +1,94 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Time parse_file() on its own, without the config, icons and rendering that
+ * come with starting trappist
+ *
+ * usage: bench-parse <menu.xml> [runs]
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "menu.h"
+#include "parse.h"
+
+static int64_t
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * Each run parses in a child process, so that it starts without the menus of
+ * the runs before. Returns the time taken in nanoseconds, or -1.
+ */
+static int64_t
+time_parse(const char *filename)
+{
+	int fds[2];
+	if (pipe(fds) < 0) {
+		return -1;
+	}
+	pid_t pid = fork();
+	if (pid == 0) {
+		close(fds[0]);
+		arena_init(NULL);
+		int64_t start = now_ns();
+		parse_file(filename);
+		int64_t ns = now_ns() - start;
+		_exit(write(fds[1], &ns, sizeof(ns)) != sizeof(ns));
+	}
+	close(fds[1]);
+	int64_t ns = -1;
+	if (pid < 0 || read(fds[0], &ns, sizeof(ns)) != sizeof(ns)) {
+		ns = -1;
+	}
+	close(fds[0]);
+	if (pid > 0) {
+		waitpid(pid, NULL, 0);
+	}
+	return ns;
+}
+
+static int
+compare_ns(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a;
+	int64_t y = *(const int64_t *)b;
+	return (x > y) - (x < y);
+}
+
+int
+main(int argc, char *argv[])
+{
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s <menu.xml> [runs]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	int runs = argc > 2 ? atoi(argv[2]) : 10;
+	if (runs < 1) {
+		runs = 1;
+	}
+	int64_t *ns = calloc(runs, sizeof(*ns));
+	if (!ns) {
+		return EXIT_FAILURE;
+	}
+	for (int i = 0; i < runs; i++) {
+		ns[i] = time_parse(argv[1]);
+		if (ns[i] < 0) {
+			fprintf(stderr, "cannot parse '%s'\n", argv[1]);
+			free(ns);
+			return EXIT_FAILURE;
+		}
+	}
+	qsort(ns, runs, sizeof(*ns), compare_ns);
+	printf("parse_file: min %.2f ms, median %.2f ms over %d runs\n",
+		ns[0] / 1e6, ns[runs / 2] / 1e6, runs);
+	free(ns);
+	return 0;
+}
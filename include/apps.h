@@ -0,0 +1,46 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#ifndef TRAPPIST_APPS_H
+#define TRAPPIST_APPS_H
+#include <stddef.h>
+#include <stdint.h>
+
+/* Id under which menu files can refer to the built-in application menu */
+#define APPS_MENU_ID "applications"
+
+struct menu;
+
+/**
+ * apps_menu_create() - Build a menu of the installed applications
+ * @id: Id to register the menu as
+ *
+ * The .desktop files in the applications/ directory of each XDG data dir are
+ * read on a pool of worker threads. Applications are grouped into one submenu
+ * per main category of the XDG menu spec, without reading any .menu or
+ * .directory files.
+ *
+ * Return: the menu, which is empty if no applications were found
+ */
+struct menu *apps_menu_create(const char *id);
+
+/**
+ * apps_menu_update() - Bring a menu from apps_menu_create() up to date
+ * @menu: The application menu
+ * @paths: Files and directories which have changed, or NULL for any
+ * @nr_paths: Number of @paths
+ *
+ * Only the .desktop files in @paths and those whose mtime has changed are
+ * read again, and only the items of applications which have changed are
+ * rendered again.
+ */
+void apps_menu_update(struct menu *menu, const char **paths, size_t nr_paths);
+
+/* Call @fn for each applications/ directory, most important first */
+void apps_for_each_dir(void (*fn)(const char *dir, void *data), void *data);
+
+/*
+ * Latest modification time (in ns) of the applications/ directories, which
+ * changes whenever a .desktop file is added, removed or replaced
+ */
+int64_t apps_stamp(void);
+
+#endif /* TRAPPIST_APPS_H */
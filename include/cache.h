@@ -0,0 +1,48 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#ifndef TRAPPIST_CACHE_H
+#define TRAPPIST_CACHE_H
+#include <glib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <talloc.h>
+#include <wayland-util.h>
+
+struct conf;
+
+/**
+ * cache_load() - Load menus from the compiled cache of a menu file
+ * @menu_file: Path to menu.xml
+ * @conf: Configuration the cache must have been compiled with
+ *
+ * The cache is only used if it was compiled from the same menu.xml (size,
+ * mtime or content hash) with the same icon theme and icon size. Strings of
+ * the loaded menus point into the mapped cache file.
+ *
+ * Return: true if menus were loaded, false if the cache is missing or stale
+ */
+bool cache_load(const char *menu_file, struct conf *conf);
+
+/**
+ * cache_save() - Compile the current menus into the cache for @menu_file
+ * Icons are expected to have been resolved to full paths already. Pipemenus
+ * are saved without the output they have fetched, and the window list without
+ * its windows.
+ */
+void cache_save(const char *menu_file, struct conf *conf);
+
+void cache_finish(void);
+
+/* Path of the file @name in $XDG_CACHE_HOME/trappist, or NULL */
+char *cache_file_path(TALLOC_CTX *ctx, const char *name);
+
+/* Atomically replace the file at @path, creating its directory if needed */
+bool cache_write_file(const char *path, const void *data, size_t size);
+
+/*
+ * Append @s to a string table unless @offsets already has it, and return its
+ * offset. Offset zero is NULL, so @strings must start with a NUL byte.
+ */
+uint32_t cache_intern(GHashTable *offsets, struct wl_array *strings,
+	const char *s);
+
+#endif /* TRAPPIST_CACHE_H */
@@ -0,0 +1,106 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#ifndef TRAPPIST_CATALOG_H
+#define TRAPPIST_CATALOG_H
+#include <glib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <wayland-util.h>
+
+/*
+ * Translated labels, from the Name[xx] keys of .desktop files and from
+ * <label xml:lang="xx"> elements of menu files. Like a gettext catalog they
+ * are keyed by the untranslated label (msgid), so menus can be cached once for
+ * every locale and translated as they are loaded.
+ */
+
+/* Most locale names tried for a label, e.g. de_DE@euro, de_DE, de@euro, de */
+#define CATALOG_MAX_LOCALES (4)
+
+/*
+ * Translation as stored in the menu cache and desktop entry index, by string
+ * offset. Entries are sorted by msgid and then locale.
+ */
+struct catalog_entry {
+	uint32_t msgid;
+	uint32_t locale;
+	uint32_t text;
+};
+
+/* Translations in a mapped file, looked up for the current locale */
+struct catalog_view {
+	const struct catalog_entry *entries;
+	size_t nr_entries;
+	const char *strings;
+	size_t strings_size;
+
+	/* offsets of the names of the current locale, most specific first */
+	uint32_t locales[CATALOG_MAX_LOCALES];
+	size_t nr_locales;
+};
+
+/*
+ * Where a translation comes from. Those of menu files are dropped when the
+ * file is parsed again, and win over those of desktop entries.
+ */
+enum catalog_source {
+	CATALOG_DESKTOP_ENTRY,
+	CATALOG_MENU_FILE,
+};
+
+/*
+ * Remember that @msgid reads @text in @locale, replacing any translation from
+ * the same @source
+ */
+void catalog_add(const char *msgid, const char *locale, const char *text,
+	enum catalog_source source);
+
+/*
+ * Forget the translations of menu files, before one is parsed again. Strings
+ * returned by catalog_translate() stay valid.
+ */
+void catalog_drop_menu_file(void);
+
+/*
+ * Translation of @msgid for the current locale, or @msgid itself. The
+ * returned string lives until catalog_finish().
+ */
+const char *catalog_translate(const char *msgid);
+
+/*
+ * catalog_write() - Store the translations of some labels in a file
+ * @msgids: Labels to store the translations of
+ * @mapped: File the labels may have been loaded from, or NULL. Translations
+ *          of labels which point into it are kept unless added since.
+ * @locales: Gets the string offsets of the locales used (uint32_t)
+ * @entries: Gets the translations (struct catalog_entry)
+ * @offsets, @strings: String table, see cache_intern()
+ */
+void catalog_write(GHashTable *msgids, const struct catalog_view *mapped,
+	struct wl_array *locales, struct wl_array *entries,
+	GHashTable *offsets, struct wl_array *strings);
+
+/*
+ * catalog_view_init() - Prepare lookups in translations stored by
+ * catalog_write()
+ *
+ * The names of the current locale are found among @locales once, so that each
+ * lookup only compares offsets.
+ *
+ * Return: false if an offset is out of bounds or entries are out of order
+ */
+bool catalog_view_init(struct catalog_view *view, const uint32_t *locales,
+	size_t nr_locales, const struct catalog_entry *entries,
+	size_t nr_entries, const char *strings, size_t strings_size);
+
+/* Offset of the translation of @msgid for the current locale, or @msgid */
+uint32_t catalog_view_translate(const struct catalog_view *view,
+	uint32_t msgid);
+
+/* Translations of @msgid in @view, for all locales */
+size_t catalog_view_find(const struct catalog_view *view, uint32_t msgid,
+	const struct catalog_entry **first);
+
+void catalog_finish(void);
+
+#endif /* TRAPPIST_CATALOG_H */
@@ -5,11 +5,32 @@
 #include <stdlib.h>
 
 struct icon {
+	char *theme;
 	int size;
 };
 
+/* When pipemenu commands are run ahead of their menu being opened */
+enum pipemenu_prefetch {
+	PIPEMENU_PREFETCH_NONE = 0,
+	PIPEMENU_PREFETCH_HOVER,
+	PIPEMENU_PREFETCH_STARTUP,
+};
+
+struct pipemenu {
+	int timeout;
+	int ttl;
+	enum pipemenu_prefetch prefetch;
+	int jobs;
+};
+
+struct daemon {
+	int budget; /* MiB resident while hidden, or 0 for no limit */
+};
+
 struct conf {
 	struct icon icon;
+	struct pipemenu pipemenu;
+	struct daemon daemon;
 };
 
 void conf_init(struct conf *conf, const char *filename);
@@ -0,0 +1,52 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#ifndef TRAPPIST_DAEMON_H
+#define TRAPPIST_DAEMON_H
+#include <stdbool.h>
+
+struct conf;
+struct state;
+
+/*
+ * A daemon keeps its menus, pixmaps and Wayland connection while the menu is
+ * hidden, and is told to show it over a unix socket in $XDG_RUNTIME_DIR, one
+ * per Wayland display. Each connection sends a single line:
+ *
+ *   show [<id>] [<x> <y>]  open the menu called <id>, or the one opened
+ *                          last, at the given position or the pointer
+ *   hide                   close the menu
+ *   toggle [<id>]          show the menu where the pointer is, or hide it
+ *                          if shown
+ *
+ * show and toggle may end with "@<output>" to pick the output to show the
+ * menu on, which is otherwise the one it was shown on last.
+ *
+ * A connection which has not sent its line within a second is closed.
+ *
+ * While hidden it holds no buffers, surfaces or timers, and runs no pipemenu
+ * commands, only the menus, their pixmaps and icons, which are what make
+ * showing it again cost a single frame.
+ */
+
+/**
+ * daemon_init() - Listen on the socket
+ * @state: State holding the event loop, with the menu hidden
+ * @conf: Configuration with the [daemon] memory budget
+ *
+ * Return: false if the socket cannot be created, or another daemon is
+ * listening on it already
+ */
+bool daemon_init(struct state *state, struct conf *conf);
+
+/* Send @command to the running daemon. Return: false if there is none */
+bool daemon_send(const char *command);
+
+/*
+ * daemon_trim() - Hand memory back to the system once the menu is hidden, and
+ * log how much is resident. Over the [daemon] budget, caches which can be
+ * filled again are dropped as well: the output of pipemenus and the icon theme.
+ */
+void daemon_trim(struct state *state);
+
+void daemon_finish(struct state *state);
+
+#endif /* TRAPPIST_DAEMON_H */
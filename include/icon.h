@@ -1,9 +1,32 @@
 #ifndef TRAPPIST_ICON_H
 #define TRAPPIST_ICON_H
+#include <stdint.h>
 
-void icon_init(void);
+void icon_init(const char *theme);
 void icon_finish(void);
 void icon_set_size(int size);
 const char *icon_strdup_path(const char *app_id);
 
+/* Pick up icons which have been installed or removed since the last lookup */
+void icon_theme_rescan(void);
+
+/* Start loading the theme on another thread, ahead of the first lookup */
+void icon_theme_preload(void);
+
+/* Unload the theme to save memory. It is loaded again by the next lookup. */
+void icon_theme_release(void);
+
+/*
+ * Call @fn with each directory that icons of the theme can come from, whether
+ * it exists or not
+ */
+void icon_for_each_theme_dir(void (*fn)(const char *dir, void *data),
+	void *data);
+
+/*
+ * Latest modification time of the directories of the theme, in nanoseconds,
+ * which changes as icons are installed or removed
+ */
+int64_t icon_theme_stamp(void);
+
 #endif /* TRAPPIST_ICON_H */
@@ -0,0 +1,21 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#ifndef TRAPPIST_LIST_H
+#define TRAPPIST_LIST_H
+
+struct menu;
+struct state;
+
+/**
+ * list_read() - Add items to a menu from lines read from a file descriptor
+ * @state: State holding the event loop
+ * @menu: Menu to add the items to, usually from menu_init_list()
+ * @fd: Descriptor to read from, such as stdin
+ *
+ * Each line is a label, optionally followed by a tab and an icon, and another
+ * tab and a command. Items without a command print their label when chosen,
+ * as in dmenu. Lines are read in chunks from the event loop, so the first
+ * items are shown while the rest are still coming in.
+ */
+void list_read(struct state *state, struct menu *menu, int fd);
+
+#endif /* TRAPPIST_LIST_H */
@@ -2,6 +2,8 @@
 #ifndef TRAPPIST_MENU_H
 #define TRAPPIST_MENU_H
 #include <cairo.h>
+#include <stdint.h>
+#include <talloc.h>
 #include <xkbcommon/xkbcommon.h>
 #include <wayland-server.h>
 
@@ -25,6 +27,7 @@
 
 struct state;
 struct conf;
+struct toplevel;
 
 struct box {
 	int x;
@@ -35,21 +38,50 @@ struct box {
 
 struct menuitem {
 	char *label;
+	/* label as written in the menu, if it has been translated */
+	char *label_id;
 	char *action;
 	char *command;
 	char *icon;
+	/* icon as named in the menu, before it was resolved to a path */
+	char *icon_name;
 	struct menu *submenu;
 	struct box box;
 	bool selectable;
+	/* chosen by printing its label, as in dmenu, see list_read() */
+	bool print;
+	/* window of an item of the window list, see toplevels.c */
+	struct toplevel *toplevel;
 	struct {
 		cairo_surface_t *active;
 		cairo_surface_t *inactive;
 	} pixmap;
 	struct wl_list link; /* menu::menuitems */
+
+	/* owning menu and position in menu::items */
+	struct menu *menu;
+	int index;
+};
+
+/*
+ * The part of a menuitem needed for hit testing, kept in a separate array so
+ * that pointer motion does not touch labels, commands or pixmaps
+ */
+#define MENUITEM_SELECTABLE (1 << 0)
+#define MENUITEM_SUBMENU (1 << 1)
+
+struct menuitem_hot {
+	int y;
+	int height;
+	uint32_t flags;
 };
 
-/* This could be the root-menu or a submenu */
+/*
+ * This could be the root-menu or a submenu. Menus created from pipemenu
+ * output are not registered and have an index of -1.
+ */
 struct menu {
+	int index;
 	char *id;
 	char *label;
 	bool visible;
@@ -59,16 +91,172 @@ struct menu {
 	bool bottom_aligned;
 	struct wl_list menuitems;
 
+	/*
+	 * items in display order, their y-sorted hit testing data and the
+	 * item the menu was last opened from
+	 */
+	struct menuitem **items;
+	struct menuitem_hot *hot;
+	int nr_items, alloc_items;
+	int items_height;
+	struct menuitem *opener;
+
+	/*
+	 * pixels by which the items of a menu taller than the screen are
+	 * scrolled up
+	 */
+	int scroll;
+
+	/*
+	 * Lazy menus, such as long lists read from stdin, only have pixmaps
+	 * for items in or near view, which are items [first, last)
+	 */
+	bool lazy;
+	struct {
+		int first;
+		int last;
+	} rendered;
+
+	/* what the current layout was computed for, see configure() */
+	struct {
+		bool valid;
+		struct box screen;
+		struct box ref;
+		bool right_aligned;
+		bool bottom_aligned;
+	} layout;
+
+	/* bookkeeping for walk_menus() */
+	unsigned int walk;
+	bool walking;
+
+	/*
+	 * pipemenu command, the running job and the context of its items,
+	 * which are kept for @ttl seconds (-1 for the default) after they
+	 * were @fetched (in monotonic microseconds, 0 if never)
+	 */
+	char *execute;
+	struct pipemenu_job *job;
+	TALLOC_CTX *content;
+	int ttl;
+	int64_t fetched;
+
 	struct state *state;
 };
 
-void menu_init(struct state *state, struct conf *conf, const char *filename);
+/*
+ * Allocate menus from a new arena on @ctx. menu_init() and menu_compile() do
+ * this themselves, and menu_finish() frees it.
+ */
+void arena_init(TALLOC_CTX *ctx);
+char *menu_strdup(const char *s);
+struct menu *menu_create(const char *id, const char *label,
+	struct menu *parent);
+
+/*
+ * Menu ids are interned and indexed in a hash table. menu_intern_id() returns
+ * the canonical copy of an id, and menu_index_id() makes a menu whose ->id
+ * has been set directly findable by get_menu_by_id().
+ */
+const char *menu_intern_id(const char *id);
+void menu_index_id(struct menu *menu);
+struct menu *get_menu_by_id(const char *id);
+int menu_count(void);
+struct menu *menu_get(int index);
+struct menuitem *item_create(struct menu *menu, const char *label);
+struct menuitem *separator_create(struct menu *menu, const char *label);
+void item_remove(struct menuitem *item);
+
+/*
+ * While @ctx is set, menus, items and strings are allocated from it instead of
+ * the arena, and new menus are not registered. Pass NULL to switch back.
+ */
+void menu_alloc_from(TALLOC_CTX *ctx);
+
+/* Remove all items of @menu, along with unregistered submenus */
+void menu_remove_items(struct menu *menu);
+
+/* Prepare new items of @menu and its submenus for display */
+void menu_items_added(struct menu *menu);
+
+/*
+ * As menu_items_added(), for the items of @menu from index @first on only, so
+ * that a menu filled in many steps is not walked again for each of them. Their
+ * submenus are prepared when opened.
+ */
+void menu_items_appended(struct menu *menu, int first);
+
+/*
+ * Render @item again after its label or icon has changed. Only its own box is
+ * drawn again if its menu is open.
+ */
+void menu_item_changed(struct menuitem *item);
+
+/* Remove @item and free it, along with anything allocated on it */
+void menu_item_destroy(struct menuitem *item);
+
+/*
+ * Replace the items of @menu with those of @from, keeping the pixmaps of items
+ * which look the same. Returns false, leaving both untouched, if the items are
+ * the same already.
+ */
+bool menu_replace_items(struct menu *menu, struct menu *from);
+
+/*
+ * menu_load() - Start loading the menus of @filename on another thread, from
+ * the cache if it is up to date, while the caller connects to the compositor.
+ * Nothing else may touch the menus until menu_init().
+ */
+void menu_load(TALLOC_CTX *ctx, struct conf *conf, const char *filename);
+
+/*
+ * menu_init() - Wait for menu_load() and get its menus ready to be shown,
+ * opening the one called @id, or root-menu if @id is NULL
+ */
+void menu_init(struct state *state, const char *id);
+
+/*
+ * menu_init_list() - Show an empty lazy menu for items to be added to, such
+ * as those read by list_read()
+ */
+void menu_init_list(TALLOC_CTX *ctx, struct state *state, struct conf *conf);
 void menu_finish(struct state *state);
+void menu_compile(TALLOC_CTX *ctx, struct conf *conf, const char *filename);
 void pixmap_pair_create(struct menuitem *item, struct conf *conf);
+
+/*
+ * pixmap_warmup() - Load fontconfig and the menu font on another thread, so
+ * that rendering the first pixmap does not wait for them. That waits for the
+ * thread instead, as does pixmap_warmup_finish().
+ */
+void pixmap_warmup(void);
+void pixmap_warmup_finish(void);
 void menu_move(struct menu *menu, int x, int y);
+
+/*
+ * menu_show() - Map the surface and open the menu called @id at @x, @y, or
+ * where the pointer is if either is negative. Any menu of the file can be
+ * opened, and all of them have their pixmaps ready. With @id NULL, the menu
+ * which was opened last is opened again. See surface_set_output() for @output.
+ */
+void menu_show(struct state *state, const char *id, const char *output, int x,
+	int y);
+
+/*
+ * menu_hide() - Close the menus, as after choosing an item or pressing
+ * Escape. This quits unless running as a daemon, which unmaps the surface and
+ * keeps the menus, pixmaps and Wayland connection for the next menu_show().
+ */
+void menu_hide(struct state *state);
+
+/* Drop the output of pipemenus, which are run again when next opened */
+void menu_drop_caches(struct state *state);
+void menu_handle_configure(struct state *state);
 void menu_handle_cursor_motion(struct menu *menu, int x, int y);
+void menu_handle_pointer_leave(struct state *state);
 void menu_handle_button_pressed(struct state *state, int x, int y);
 void menu_handle_button_released(struct state *state, int x, int y);
+void menu_handle_scroll(struct state *state, int x, int y, int dy);
 void menu_handle_key(struct state *state, xkb_keysym_t keysym,
 	uint32_t codepoint);
 
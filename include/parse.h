@@ -0,0 +1,38 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#ifndef TRAPPIST_PARSE_H
+#define TRAPPIST_PARSE_H
+#include <stdbool.h>
+
+/**
+ * parse_file() - Build menus from an openbox menu file
+ * @filename: Path to menu.xml
+ *
+ * The file is mapped and fed to a SAX parser in a single pass, creating
+ * menus and items as the elements stream by.
+ *
+ * Return: true if the whole file was read and is well-formed
+ */
+bool parse_file(const char *filename);
+
+struct menu;
+struct stream;
+
+/**
+ * parse_stream_create() - Start parsing menu xml as it arrives
+ * @menu: Menu that items at the top level are added to
+ *
+ * This is used for the output of pipemenus, which looks like
+ * <openbox_pipe_menu><item label=""/>...</openbox_pipe_menu>
+ */
+struct stream *parse_stream_create(struct menu *menu);
+
+/* Return: false if the data is not well-formed */
+bool parse_stream_feed(struct stream *stream, const char *data, int len);
+
+/* Parse what is left, resolve references and free @stream */
+bool parse_stream_finish(struct stream *stream);
+
+/* Free @stream, leaving items that have been added so far in place */
+void parse_stream_cancel(struct stream *stream);
+
+#endif /* TRAPPIST_PARSE_H */
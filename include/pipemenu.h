@@ -0,0 +1,65 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#ifndef TRAPPIST_PIPEMENU_H
+#define TRAPPIST_PIPEMENU_H
+
+struct conf;
+struct menu;
+struct state;
+
+/**
+ * pipemenu_run() - Fill a pipemenu from the output of its command
+ * @state: State holding the event loop
+ * @menu: Menu with ->execute set
+ * @conf: Configuration with the pipemenu timeout
+ *
+ * The command runs in the background and items are added to @menu as its
+ * output is read, so nothing blocks on it. Items from an earlier run are kept
+ * until their ttl has passed. After that they are still shown while the
+ * command runs again, and are then replaced by its output. Output is kept per
+ * command, and taken over from another pipemenu with the same command unless
+ * that one is open.
+ */
+void pipemenu_run(struct state *state, struct menu *menu, struct conf *conf);
+
+/*
+ * pipemenu_prefetch() - Start the command of @menu before it is opened
+ *
+ * Used when the pointer enters the item of a pipemenu. Nothing is started if
+ * prefetching is disabled or the [pipemenu] jobs limit has been reached.
+ */
+void pipemenu_prefetch(struct state *state, struct menu *menu,
+	struct conf *conf);
+
+/* Stop a command started by pipemenu_prefetch() unless @menu was opened */
+void pipemenu_cancel_prefetch(struct menu *menu);
+
+/* Run the command of @menu in the background once a job is free */
+void pipemenu_enqueue(struct menu *menu, struct conf *conf);
+
+/*
+ * Stop all commands while the menu is hidden, and start none until
+ * pipemenu_resume(). Those run ahead of time are started again then.
+ */
+void pipemenu_park(void);
+
+void pipemenu_resume(struct conf *conf);
+
+/* Stop the command of @menu if it is still running */
+void pipemenu_cancel(struct menu *menu);
+
+/* Stop the command and drop all items of @menu */
+void pipemenu_clear(struct menu *menu);
+
+/*
+ * Pipemenu holding the output of the command of @menu, which is @menu itself
+ * unless another pipemenu with the same command ran it last
+ */
+struct menu *pipemenu_holder(struct menu *menu);
+
+/*
+ * Move the items which @old got from its command over to @menu, along with a
+ * refresh of them that is still running
+ */
+void pipemenu_adopt(struct menu *menu, struct menu *old);
+
+#endif /* TRAPPIST_PIPEMENU_H */
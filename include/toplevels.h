@@ -0,0 +1,48 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#ifndef TRAPPIST_TOPLEVELS_H
+#define TRAPPIST_TOPLEVELS_H
+#include <stdint.h>
+
+/* Id under which menu files can refer to the built-in window list */
+#define TOPLEVELS_MENU_ID "client-list-combined-menu"
+
+struct menu;
+struct menuitem;
+struct state;
+struct wl_registry;
+
+/**
+ * toplevels_init() - Bind the wlr foreign toplevel manager
+ * @state: State to keep the manager in
+ * @registry: Registry which announced the global
+ * @name: Name of the global
+ * @version: Version of the global
+ *
+ * From then on, the menu registered as TOPLEVELS_MENU_ID, if any, holds one
+ * item per window. It is updated in place as windows are opened, closed or
+ * renamed, so only the items of those windows are rendered again.
+ */
+void toplevels_init(struct state *state, struct wl_registry *registry,
+	uint32_t name, uint32_t version);
+
+/* Create a menu for the open windows, which toplevels_menu_fill() adds */
+struct menu *toplevels_menu_create(const char *id);
+
+/*
+ * Add one item per open window to @menu, after any items of its own, once the
+ * menu file is loaded. Windows are not known to the thread which loads it.
+ */
+void toplevels_menu_fill(struct menu *menu);
+
+/*
+ * Update the window items of @menu again as their windows change, as those of
+ * a menu file which could not be reloaded are kept
+ */
+void toplevels_menu_relink(struct menu *menu);
+
+/* Activate the window of @item, an item with a window */
+void toplevels_activate(struct state *state, struct menuitem *item);
+
+void toplevels_finish(struct state *state);
+
+#endif /* TRAPPIST_TOPLEVELS_H */
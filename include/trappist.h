@@ -10,6 +10,7 @@
 #include <xkbcommon/xkbcommon.h>
 
 struct loop_timer;
+struct zwlr_foreign_toplevel_manager_v1;
 struct zwlr_layer_shell_v1;
 
 struct state {
@@ -25,20 +26,38 @@ struct state {
 	struct menu *menu;
 	struct menuitem *selection;
 
+	/* struct menu *, from the root menu down to the deepest open submenu */
+	struct wl_array open_menus;
+
+	/* kept running while the menu is hidden, see daemon.h */
+	bool daemon;
+
 	struct loop *eventloop;
 	struct loop_timer *hover_timer;
 	struct zwlr_layer_shell_v1 *layer_shell;
+	struct zwlr_foreign_toplevel_manager_v1 *toplevel_manager;
 };
 
-/* TODO: Use scale and subpixel */
+/* TODO: Use subpixel */
 struct output {
 	struct state *state;
 
 	char *name;
+	uint32_t global;
 	struct wl_output *wl_output;
 	int32_t scale;
 	enum wl_output_subpixel subpixel;
 
+	/*
+	 * A layer surface on this output which is configured but has no
+	 * buffer, so it stays unmapped until surface_map() takes it over
+	 */
+	struct {
+		struct wl_surface *surface;
+		struct zwlr_layer_surface_v1 *layer_surface;
+		uint32_t width, height;
+	} ready;
+
 	struct wl_list link; /* state::outputs */
 };
 
@@ -69,6 +88,7 @@ struct pointer_event {
 
 struct seat {
 	struct state *state;
+	struct wl_seat *wl_seat;
 
 	struct wl_pointer *pointer;
 	struct wl_surface *cursor_surface;
@@ -94,25 +114,59 @@ struct surface {
 	struct state *state;
 
 	cairo_surface_t *image;
-	struct wl_output *wl_output;
+	struct output *output; /* where the menu is shown, or is shown next */
 	struct wl_surface *surface;
 	struct pool_buffer buffers[2];
-	bool frame_pending, dirty;
+	struct wl_callback *frame; /* pending frame callback, if any */
+	bool dirty;
 	uint32_t width, height;
 	struct zwlr_layer_surface_v1 *layer_surface;
+
+	/*
+	 * Areas of each of @buffers to draw again before it is next attached,
+	 * or all of it if @full
+	 */
+	struct {
+		struct wl_array rects; /* cairo_rectangle_int_t */
+		bool full;
+	} damage[2];
 };
 
 void key_handle(struct state *state, xkb_keysym_t keysym, uint32_t codepoint);
 void render_frame(struct surface *surface);
-void surface_layer_surface_create(struct surface *surface);
+
+/*
+ * surface_map() - Show @surface on its output, drawing it straight away with
+ * the layer surface made ready there by surface_prepare(), or else once it is
+ * configured. Its buffers are released by surface_unmap() and allocated again
+ * by that first frame, as the pixmaps it is drawn from are kept.
+ */
+void surface_map(struct surface *surface);
+void surface_unmap(struct surface *surface);
+
+/*
+ * surface_set_output() - Show @surface on the output called @name from now on,
+ * or if NULL on the one it was last shown on, or else on any. It is unmapped
+ * if shown elsewhere. Return: false if there is no such output
+ */
+bool surface_set_output(struct surface *surface, const char *name);
+
+/* Get a layer surface on @output configured before the menu is shown there */
+void surface_prepare(struct output *output);
+void surface_unprepare(struct output *output);
 bool surface_is_configured(struct surface *surface);
 void surface_damage(struct surface *surface);
+void surface_damage_rect(struct surface *surface, int x, int y, int width,
+	int height);
 void surface_destroy(struct surface *surface);
 void seat_init(struct state *state, struct wl_seat *wl_seat);
 void globals_init(struct state *state);
-void output_init(struct state *state, struct wl_output *wl_output);
+void output_init(struct state *state, struct wl_output *wl_output,
+	uint32_t global);
+void output_destroy(struct output *output);
 void search_remove_last_uft8_character(void);
 void search_add_utf8_character(uint32_t codepoint);
 char *search_str(void);
+void search_clear(void);
 
 #endif /* TRAPPIST_H */
@@ -0,0 +1,47 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#ifndef TRAPPIST_WATCH_H
+#define TRAPPIST_WATCH_H
+#include <stddef.h>
+
+struct loop;
+struct watch;
+
+/**
+ * watch_file() - Get notified when a file has been written or replaced
+ * @loop: Event loop to add the inotify descriptor to
+ * @path: File to watch
+ * @callback: Called once changes have settled
+ * @data: Passed to @callback
+ *
+ * The directory containing @path is watched so that files replaced by
+ * rename() are noticed too. Bursts of events are collapsed into a single
+ * call of @callback.
+ *
+ * Return: the watch, or NULL on failure
+ */
+struct watch *watch_file(struct loop *loop, const char *path,
+	void (*callback)(void *data), void *data);
+
+/**
+ * watch_dirs() - Get notified of files changing in directory trees
+ * @loop: Event loop to add the inotify descriptor to
+ * @callback: Called once changes have settled
+ * @data: Passed to @callback
+ *
+ * Directories are added with watch_add_dir(). @callback gets the paths of the
+ * files and directories which have been written, created, removed or renamed
+ * since its last call. If events were lost, @paths is NULL and anything may
+ * have changed.
+ *
+ * Return: the watch, or NULL on failure
+ */
+struct watch *watch_dirs(struct loop *loop,
+	void (*callback)(const char **paths, size_t nr_paths, void *data),
+	void *data);
+
+/* Watch @path and its subdirectories, if it exists */
+void watch_add_dir(struct watch *watch, const char *path);
+
+void watch_destroy(struct watch *watch);
+
+#endif /* TRAPPIST_WATCH_H */
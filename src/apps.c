@@ -0,0 +1,1018 @@
+// SPDX-License-Identifier: GPL-2.0-only
+#define _POSIX_C_SOURCE 200809L
+#include <dirent.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <ini.h>
+#include <pthread.h>
+#include <sfdo-basedir.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sway-client-helpers/log.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <wayland-util.h>
+#include "apps.h"
+#include "cache.h"
+#include "catalog.h"
+#include "menu.h"
+#include "talloc-helpers.h"
+
+/* Upper limit of threads reading .desktop files */
+#define APPS_MAX_THREADS (8)
+
+/* Below this many files per thread, threads cost more than they save */
+#define APPS_FILES_PER_THREAD (32)
+
+/* An application read from a .desktop file, or taken from the index */
+struct app {
+	char *id;
+	char *path;
+	int64_t mtime;
+	bool parsed;
+	char *type;
+	char *name;
+	/* Name[xx] keys as pairs of locale and name, see catalog_add() */
+	GPtrArray *names;
+	char *exec;
+	char *icon;
+	char *categories;
+	char *only_show_in;
+	char *not_show_in;
+	bool no_display;
+	bool hidden;
+};
+
+/* .desktop files shared by the worker threads, which take the next one */
+struct scan {
+	struct app *apps;
+	size_t nr_apps;
+	atomic_size_t next;
+};
+
+/*
+ * The desktop entry index keeps what was read from each .desktop file, so
+ * that only files in directories which have changed need to be read again.
+ * Like the menu cache, it is a header followed by arrays of directories and
+ * entries, the translations of names and a string table. String offset zero
+ * denotes NULL.
+ */
+#define INDEX_MAGIC "TRAPAPPS"
+#define INDEX_VERSION (2)
+#define INDEX_FILE "apps.index"
+
+struct index_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t nr_dirs;
+	uint32_t nr_entries;
+	uint32_t nr_locales;
+	uint32_t nr_translations;
+	uint32_t strings_size;
+};
+
+/* Directories are stored parents first, each with a range of entries */
+struct index_dir {
+	int64_t mtime;
+	uint32_t path;
+	uint32_t prefix;
+	int32_t parent;
+	uint32_t first_entry;
+	uint32_t nr_entries;
+	uint32_t reserved;
+};
+
+enum index_entry_flags {
+	INDEX_ENTRY_NO_DISPLAY = 1 << 0,
+	INDEX_ENTRY_HIDDEN = 1 << 1,
+};
+
+struct index_entry {
+	int64_t mtime;
+	uint32_t id;
+	uint32_t path;
+	uint32_t type;
+	uint32_t name;
+	uint32_t exec;
+	uint32_t icon;
+	uint32_t categories;
+	uint32_t only_show_in;
+	uint32_t not_show_in;
+	uint32_t flags;
+};
+
+struct index {
+	void *data;
+	size_t size;
+	const struct index_header *header;
+	const struct index_dir *dirs;
+	const struct index_entry *entries;
+	const char *strings;
+	struct catalog_view translations;
+
+	/* path to index + 1, built when a directory has changed */
+	GHashTable *entries_by_path;
+};
+
+/* A directory searched for .desktop files, with its range of apps */
+struct scan_dir {
+	char *path;
+	char *prefix;
+	int parent;
+	int64_t mtime;
+	size_t first_app;
+	size_t nr_apps;
+};
+
+struct collect {
+	struct wl_array apps; /* struct app */
+	struct wl_array dirs; /* struct scan_dir */
+	struct index *index;
+	bool changed;
+
+	/* paths to read again even if their mtime is unchanged */
+	GHashTable *dirty;
+	bool all_dirty;
+};
+
+/* Main categories of the XDG menu spec, in the order their menus appear */
+static const struct category {
+	const char *name;
+	const char *label;
+	const char *icon;
+} categories[] = {
+	{ "Utility", "Accessories", "applications-accessories" },
+	{ "Development", "Development", "applications-development" },
+	{ "Education", "Education", "applications-education" },
+	{ "Game", "Games", "applications-games" },
+	{ "Graphics", "Graphics", "applications-graphics" },
+	{ "Network", "Internet", "applications-internet" },
+	{ "AudioVideo", "Multimedia", "applications-multimedia" },
+	{ "Office", "Office", "applications-office" },
+	{ "Science", "Science", "applications-science" },
+	{ "Settings", "Settings", "preferences-desktop" },
+	{ "System", "System", "applications-system" },
+	{ NULL, "Other", "applications-other" },
+};
+
+#define NR_CATEGORIES (sizeof(categories) / sizeof(categories[0]))
+
+static bool
+list_contains(const char *list, char separator, const char *word)
+{
+	size_t len = strlen(word);
+	for (const char *p = list; p && *p; ) {
+		const char *end = strchr(p, separator);
+		size_t n = end ? (size_t)(end - p) : strlen(p);
+		if (n == len && !strncmp(p, word, len)) {
+			return true;
+		}
+		p = end ? end + 1 : NULL;
+	}
+	return false;
+}
+
+static size_t
+category_of(struct app *app)
+{
+	char **names = g_strsplit(app->categories ? app->categories : "", ";", -1);
+	size_t index = NR_CATEGORIES - 1;
+	for (char **name = names; *name && index == NR_CATEGORIES - 1; name++) {
+		/* Audio and Video are meant to come with AudioVideo, but may not */
+		const char *main = *name;
+		if (!strcmp(main, "Audio") || !strcmp(main, "Video")) {
+			main = "AudioVideo";
+		}
+		for (size_t i = 0; i < NR_CATEGORIES - 1; i++) {
+			if (!strcmp(main, categories[i].name)) {
+				index = i;
+				break;
+			}
+		}
+	}
+	g_strfreev(names);
+	return index;
+}
+
+static int
+handle_entry(void *user, const char *section, const char *name,
+		const char *value)
+{
+	struct app *app = user;
+	if (strcmp(section, "Desktop Entry")) {
+		return 1;
+	}
+	char **field = NULL;
+	if (!strcmp(name, "Type")) {
+		field = &app->type;
+	} else if (!strcmp(name, "Name")) {
+		field = &app->name;
+	} else if (g_str_has_prefix(name, "Name[")
+			&& g_str_has_suffix(name, "]")) {
+		if (!app->names) {
+			app->names = g_ptr_array_new_with_free_func(g_free);
+		}
+		g_ptr_array_add(app->names,
+			g_strndup(name + 5, strlen(name) - 6));
+		g_ptr_array_add(app->names, g_strdup(value));
+	} else if (!strcmp(name, "Exec")) {
+		field = &app->exec;
+	} else if (!strcmp(name, "Icon")) {
+		field = &app->icon;
+	} else if (!strcmp(name, "Categories")) {
+		field = &app->categories;
+	} else if (!strcmp(name, "OnlyShowIn")) {
+		field = &app->only_show_in;
+	} else if (!strcmp(name, "NotShowIn")) {
+		field = &app->not_show_in;
+	} else if (!strcmp(name, "NoDisplay")) {
+		app->no_display = !strcmp(value, "true");
+	} else if (!strcmp(name, "Hidden")) {
+		app->hidden = !strcmp(value, "true");
+	}
+	if (field && !*field) {
+		*field = g_strdup(value);
+	}
+	return 1;
+}
+
+static bool
+is_shown(struct app *app, char **desktops)
+{
+	if (app->hidden || app->no_display || !app->name || !app->exec
+			|| !app->type || strcmp(app->type, "Application")) {
+		return false;
+	}
+	if (!app->only_show_in && !app->not_show_in) {
+		return true;
+	}
+	bool shown = !app->only_show_in;
+	for (char **desktop = desktops; desktop && *desktop; desktop++) {
+		if (list_contains(app->not_show_in, ';', *desktop)) {
+			return false;
+		}
+		if (list_contains(app->only_show_in, ';', *desktop)) {
+			shown = true;
+		}
+	}
+	return shown;
+}
+
+/* Drop the field codes (%f, %U and so on) from an Exec value */
+static char *
+strip_field_codes(const char *exec)
+{
+	GString *command = g_string_new(NULL);
+	for (const char *p = exec; *p; p++) {
+		if (*p != '%') {
+			g_string_append_c(command, *p);
+		} else if (p[1] == '%') {
+			g_string_append_c(command, '%');
+			p++;
+		} else if (p[1]) {
+			p++;
+		}
+	}
+	return g_strchomp(g_string_free(command, FALSE));
+}
+
+/* Runs on the worker threads, so must not touch talloc or the menus */
+static void *
+scan_worker(void *data)
+{
+	struct scan *scan = data;
+	for (;;) {
+		size_t i = atomic_fetch_add(&scan->next, 1);
+		if (i >= scan->nr_apps) {
+			break;
+		}
+		struct app *app = &scan->apps[i];
+		if (!app->parsed) {
+			ini_parse(app->path, handle_entry, app);
+			app->parsed = true;
+		}
+	}
+	return NULL;
+}
+
+/* Read the .desktop files of @apps which were not found in the index */
+static void
+run_scan(struct app *apps, size_t nr_apps, size_t nr_unparsed)
+{
+	struct scan scan = {
+		.apps = apps,
+		.nr_apps = nr_apps,
+	};
+	atomic_init(&scan.next, 0);
+
+	long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t nr_threads = nr_unparsed / APPS_FILES_PER_THREAD;
+	if (nr_threads > (size_t)nr_cpus - 1) {
+		nr_threads = nr_cpus > 1 ? nr_cpus - 1 : 0;
+	}
+	if (nr_threads > APPS_MAX_THREADS) {
+		nr_threads = APPS_MAX_THREADS;
+	}
+
+	pthread_t threads[APPS_MAX_THREADS];
+	size_t nr_started = 0;
+	for (; nr_started < nr_threads; nr_started++) {
+		if (pthread_create(&threads[nr_started], NULL, scan_worker,
+				&scan)) {
+			break;
+		}
+	}
+	/* The calling thread does its share too */
+	scan_worker(&scan);
+	for (size_t i = 0; i < nr_started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+}
+
+static int64_t
+mtime_of(const struct stat *st)
+{
+	return st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+}
+
+static const char *
+index_string(struct index *index, uint32_t offset)
+{
+	return offset ? index->strings + offset : NULL;
+}
+
+/* Check every index and offset before the index is used */
+static bool
+index_valid(struct index *index)
+{
+	const struct index_header *header = index->header;
+	if (memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic))
+			|| header->version != INDEX_VERSION) {
+		return false;
+	}
+	uint64_t expected = sizeof(*header)
+		+ (uint64_t)header->nr_dirs * sizeof(struct index_dir)
+		+ (uint64_t)header->nr_entries * sizeof(struct index_entry)
+		+ (uint64_t)header->nr_locales * sizeof(uint32_t)
+		+ (uint64_t)header->nr_translations
+			* sizeof(struct catalog_entry)
+		+ header->strings_size;
+	uint32_t nr_strings = header->strings_size;
+	if (expected != index->size || !nr_strings || index->strings[0]
+			|| index->strings[nr_strings - 1]) {
+		return false;
+	}
+	for (uint32_t i = 0; i < header->nr_dirs; i++) {
+		const struct index_dir *dir = &index->dirs[i];
+		if (!dir->path || dir->path >= nr_strings
+				|| dir->prefix >= nr_strings
+				|| dir->parent >= (int32_t)i
+				|| dir->first_entry > header->nr_entries
+				|| dir->nr_entries
+					> header->nr_entries - dir->first_entry) {
+			return false;
+		}
+	}
+	for (uint32_t i = 0; i < header->nr_entries; i++) {
+		const struct index_entry *e = &index->entries[i];
+		const uint32_t strings[] = { e->type, e->name, e->exec, e->icon,
+			e->categories, e->only_show_in, e->not_show_in };
+		if (!e->id || e->id >= nr_strings || !e->path
+				|| e->path >= nr_strings) {
+			return false;
+		}
+		for (size_t j = 0; j < sizeof(strings) / sizeof(*strings); j++) {
+			if (strings[j] >= nr_strings) {
+				return false;
+			}
+		}
+	}
+	const uint32_t *locales = (const void *)(index->entries
+		+ header->nr_entries);
+	return catalog_view_init(&index->translations, locales,
+		header->nr_locales, (const void *)(locales + header->nr_locales),
+		header->nr_translations, index->strings, nr_strings);
+}
+
+static struct index *
+index_load(void)
+{
+	TALLOC_CTX *tal defer = xtalloc_new(NULL);
+	char *path = cache_file_path(tal, INDEX_FILE);
+	int fd = path ? open(path, O_RDONLY | O_CLOEXEC) : -1;
+	if (fd < 0) {
+		return NULL;
+	}
+	struct stat st;
+	if (fstat(fd, &st)
+			|| (size_t)st.st_size < sizeof(struct index_header)) {
+		close(fd);
+		return NULL;
+	}
+	void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		return NULL;
+	}
+
+	struct index *index = calloc(1, sizeof(*index));
+	index->data = data;
+	index->size = st.st_size;
+	index->header = data;
+	index->dirs = (const void *)(index->header + 1);
+	index->entries = (const void *)(index->dirs + index->header->nr_dirs);
+	index->strings = (const char *)(index->entries
+		+ index->header->nr_entries) + index->header->nr_locales
+		* sizeof(uint32_t) + index->header->nr_translations
+		* sizeof(struct catalog_entry);
+	if (!index_valid(index)) {
+		LOG(LOG_ERROR, "corrupt desktop entry index");
+		munmap(data, st.st_size);
+		free(index);
+		return NULL;
+	}
+	return index;
+}
+
+static void
+index_destroy(struct index *index)
+{
+	if (!index) {
+		return;
+	}
+	if (index->entries_by_path) {
+		g_hash_table_destroy(index->entries_by_path);
+	}
+	munmap(index->data, index->size);
+	free(index);
+}
+
+static const struct index_dir *
+index_find_dir(struct index *index, const char *path)
+{
+	for (uint32_t i = 0; index && i < index->header->nr_dirs; i++) {
+		if (!strcmp(index_string(index, index->dirs[i].path), path)) {
+			return &index->dirs[i];
+		}
+	}
+	return NULL;
+}
+
+static const struct index_entry *
+index_find_entry(struct index *index, const char *path)
+{
+	if (!index) {
+		return NULL;
+	}
+	if (!index->entries_by_path) {
+		index->entries_by_path = g_hash_table_new(g_str_hash,
+			g_str_equal);
+		for (uint32_t i = 0; i < index->header->nr_entries; i++) {
+			g_hash_table_insert(index->entries_by_path,
+				(gpointer)index_string(index,
+					index->entries[i].path),
+				GUINT_TO_POINTER(i + 1));
+		}
+	}
+	guint i = GPOINTER_TO_UINT(g_hash_table_lookup(index->entries_by_path,
+		path));
+	return i ? &index->entries[i - 1] : NULL;
+}
+
+static void
+add_indexed_app(struct collect *collect, const struct index_entry *e)
+{
+	struct index *index = collect->index;
+	struct app *app = wl_array_add(&collect->apps, sizeof(*app));
+	*app = (struct app){
+		.id = g_strdup(index_string(index, e->id)),
+		.path = g_strdup(index_string(index, e->path)),
+		.mtime = e->mtime,
+		.parsed = true,
+		.type = g_strdup(index_string(index, e->type)),
+		.name = g_strdup(index_string(index, e->name)),
+		.exec = g_strdup(index_string(index, e->exec)),
+		.icon = g_strdup(index_string(index, e->icon)),
+		.categories = g_strdup(index_string(index, e->categories)),
+		.only_show_in = g_strdup(index_string(index, e->only_show_in)),
+		.not_show_in = g_strdup(index_string(index, e->not_show_in)),
+		.no_display = e->flags & INDEX_ENTRY_NO_DISPLAY,
+		.hidden = e->flags & INDEX_ENTRY_HIDDEN,
+	};
+	const struct catalog_entry *first;
+	size_t n = catalog_view_find(&index->translations, e->name, &first);
+	for (size_t i = 0; e->name && i < n; i++) {
+		catalog_add(app->name, index_string(index, first[i].locale),
+			index_string(index, first[i].text),
+			CATALOG_DESKTOP_ENTRY);
+	}
+}
+
+static size_t
+nr_collected(struct collect *collect)
+{
+	return collect->apps.size / sizeof(struct app);
+}
+
+static bool
+is_dirty(struct collect *collect, const char *path)
+{
+	return collect->all_dirty || (collect->dirty
+		&& g_hash_table_contains(collect->dirty, path));
+}
+
+/*
+ * Add the .desktop files in @path, with ids prefixed by @prefix, and then
+ * those in its subdirectories. The files of a directory whose mtime is the
+ * same as in the index are taken from the index without even listing it.
+ */
+static void
+collect_dir(struct collect *collect, const char *path, const char *prefix,
+		int parent)
+{
+	struct stat st;
+	if (stat(path, &st) || !S_ISDIR(st.st_mode)) {
+		return;
+	}
+	int index = collect->dirs.size / sizeof(struct scan_dir);
+	struct scan_dir *dir = wl_array_add(&collect->dirs, sizeof(*dir));
+	*dir = (struct scan_dir){
+		.path = g_strdup(path),
+		.prefix = g_strdup(prefix),
+		.parent = parent,
+		.mtime = mtime_of(&st),
+		.first_app = nr_collected(collect),
+	};
+	GPtrArray *subdirs = g_ptr_array_new_with_free_func(g_free);
+
+	const struct index_dir *known = index_find_dir(collect->index, path);
+	if (known && known->mtime == dir->mtime && !is_dirty(collect, path)) {
+		struct index *idx = collect->index;
+		for (uint32_t i = 0; i < known->nr_entries; i++) {
+			add_indexed_app(collect,
+				&idx->entries[known->first_entry + i]);
+		}
+		for (uint32_t i = 0; i < idx->header->nr_dirs; i++) {
+			if (idx->dirs[i].parent == known - idx->dirs) {
+				g_ptr_array_add(subdirs, g_strdup(index_string(
+					idx, idx->dirs[i].path)));
+			}
+		}
+	} else {
+		collect->changed = true;
+		DIR *d = opendir(path);
+		struct dirent *entry;
+		while (d && (entry = readdir(d))) {
+			const char *name = entry->d_name;
+			if (name[0] == '.') {
+				continue;
+			}
+			char *file = g_build_filename(path, name, NULL);
+			if (!g_str_has_suffix(name, ".desktop")) {
+				g_ptr_array_add(subdirs, file);
+				continue;
+			}
+			if (stat(file, &st)) {
+				g_free(file);
+				continue;
+			}
+			const struct index_entry *e =
+				index_find_entry(collect->index, file);
+			if (e && e->mtime == mtime_of(&st)
+					&& !is_dirty(collect, file)) {
+				add_indexed_app(collect, e);
+				g_free(file);
+				continue;
+			}
+			struct app *app = wl_array_add(&collect->apps,
+				sizeof(*app));
+			*app = (struct app){
+				.id = g_strconcat(prefix, name, NULL),
+				.path = file,
+				.mtime = mtime_of(&st),
+			};
+		}
+		if (d) {
+			closedir(d);
+		}
+	}
+	dir = (struct scan_dir *)collect->dirs.data + index;
+	dir->nr_apps = nr_collected(collect) - dir->first_app;
+
+	/* Files in subdirectories have ids like subdir-name.desktop */
+	for (guint i = 0; i < subdirs->len; i++) {
+		const char *subdir = subdirs->pdata[i];
+		char *subprefix = g_strconcat(prefix,
+			strrchr(subdir, '/') + 1, "-", NULL);
+		collect_dir(collect, subdir, subprefix, index);
+		g_free(subprefix);
+	}
+	g_ptr_array_free(subdirs, TRUE);
+}
+
+void
+apps_for_each_dir(void (*fn)(const char *dir, void *data), void *data)
+{
+	struct sfdo_basedir_ctx *ctx = sfdo_basedir_ctx_create();
+	if (!ctx) {
+		LOG(LOG_ERROR, "no sfdo_basedir_ctx");
+		return;
+	}
+	size_t nr_dirs;
+	const struct sfdo_string *dirs = sfdo_basedir_get_data_dirs(ctx, &nr_dirs);
+	for (size_t i = 0; i < nr_dirs; i++) {
+		char *base = g_strndup(dirs[i].data, dirs[i].len);
+		char *dir = g_build_filename(base, "applications", NULL);
+		fn(dir, data);
+		g_free(dir);
+		g_free(base);
+	}
+	sfdo_basedir_ctx_destroy(ctx);
+}
+
+static void
+add_dir(const char *dir, void *data)
+{
+	collect_dir(data, dir, "", -1);
+}
+
+static void
+index_save(struct collect *collect)
+{
+	TALLOC_CTX *tal defer = xtalloc_new(NULL);
+	char *path = cache_file_path(tal, INDEX_FILE);
+	if (!path) {
+		return;
+	}
+	struct wl_array buf, locales, translations, strings;
+	wl_array_init(&buf);
+	wl_array_init(&locales);
+	wl_array_init(&translations);
+	wl_array_init(&strings);
+	GHashTable *offsets = g_hash_table_new(g_str_hash, g_str_equal);
+	GHashTable *names = g_hash_table_new(g_str_hash, g_str_equal);
+	*(char *)wl_array_add(&strings, 1) = '\0';
+
+	struct index_header header = {
+		.version = INDEX_VERSION,
+		.nr_dirs = collect->dirs.size / sizeof(struct scan_dir),
+		.nr_entries = nr_collected(collect),
+	};
+	memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+	wl_array_add(&buf, sizeof(header));
+
+	struct scan_dir *dir;
+	wl_array_for_each(dir, &collect->dirs) {
+		struct index_dir *d = wl_array_add(&buf, sizeof(*d));
+		*d = (struct index_dir){
+			.mtime = dir->mtime,
+			.path = cache_intern(offsets, &strings, dir->path),
+			.prefix = cache_intern(offsets, &strings, dir->prefix),
+			.parent = dir->parent,
+			.first_entry = dir->first_app,
+			.nr_entries = dir->nr_apps,
+		};
+	}
+	struct app *app;
+	wl_array_for_each(app, &collect->apps) {
+		struct index_entry *e = wl_array_add(&buf, sizeof(*e));
+		*e = (struct index_entry){
+			.mtime = app->mtime,
+			.id = cache_intern(offsets, &strings, app->id),
+			.path = cache_intern(offsets, &strings, app->path),
+			.type = cache_intern(offsets, &strings, app->type),
+			.name = cache_intern(offsets, &strings, app->name),
+			.exec = cache_intern(offsets, &strings, app->exec),
+			.icon = cache_intern(offsets, &strings, app->icon),
+			.categories = cache_intern(offsets, &strings,
+				app->categories),
+			.only_show_in = cache_intern(offsets, &strings,
+				app->only_show_in),
+			.not_show_in = cache_intern(offsets, &strings,
+				app->not_show_in),
+			.flags = (app->no_display ? INDEX_ENTRY_NO_DISPLAY : 0)
+				| (app->hidden ? INDEX_ENTRY_HIDDEN : 0),
+		};
+		if (app->name) {
+			g_hash_table_add(names, app->name);
+		}
+	}
+	catalog_write(names, NULL, &locales, &translations, offsets, &strings);
+	header.nr_locales = locales.size / sizeof(uint32_t);
+	header.nr_translations = translations.size
+		/ sizeof(struct catalog_entry);
+	header.strings_size = strings.size;
+	memcpy(buf.data, &header, sizeof(header));
+	memcpy(wl_array_add(&buf, locales.size), locales.data, locales.size);
+	memcpy(wl_array_add(&buf, translations.size), translations.data,
+		translations.size);
+	memcpy(wl_array_add(&buf, strings.size), strings.data, strings.size);
+
+	if (!cache_write_file(path, buf.data, buf.size)) {
+		LOG_ERRNO(LOG_ERROR, "cannot write desktop entry index '%s'",
+			path);
+	}
+	g_hash_table_destroy(offsets);
+	g_hash_table_destroy(names);
+	wl_array_release(&buf);
+	wl_array_release(&locales);
+	wl_array_release(&translations);
+	wl_array_release(&strings);
+}
+
+static int
+compare_names(const void *a, const void *b)
+{
+	const struct app *const *x = a, *const *y = b;
+	return g_utf8_collate(catalog_translate((*x)->name),
+		catalog_translate((*y)->name));
+}
+
+static void
+free_app(struct app *app)
+{
+	g_free(app->id);
+	g_free(app->path);
+	g_free(app->type);
+	g_free(app->name);
+	if (app->names) {
+		g_ptr_array_free(app->names, TRUE);
+	}
+	g_free(app->exec);
+	g_free(app->icon);
+	g_free(app->categories);
+	g_free(app->only_show_in);
+	g_free(app->not_show_in);
+}
+
+/*
+ * Find the .desktop files and read those which are not in the index, or are
+ * in @collect->dirty
+ */
+static void
+collect_apps(struct collect *collect)
+{
+	collect->index = index_load();
+	wl_array_init(&collect->apps);
+	wl_array_init(&collect->dirs);
+	apps_for_each_dir(add_dir, collect);
+
+	/* A directory may have been removed without any other changing */
+	size_t nr_dirs = collect->dirs.size / sizeof(struct scan_dir);
+	if (!collect->index || collect->index->header->nr_dirs != nr_dirs) {
+		collect->changed = true;
+	}
+
+	size_t nr_unparsed = 0;
+	struct app *app;
+	wl_array_for_each(app, &collect->apps) {
+		nr_unparsed += !app->parsed;
+	}
+	run_scan(collect->apps.data, nr_collected(collect), nr_unparsed);
+
+	/* The catalog is not thread-safe, so it is filled in afterwards */
+	wl_array_for_each(app, &collect->apps) {
+		for (guint i = 0; app->name && app->names
+				&& i + 1 < app->names->len; i += 2) {
+			catalog_add(app->name, app->names->pdata[i],
+				app->names->pdata[i + 1],
+				CATALOG_DESKTOP_ENTRY);
+		}
+	}
+	if (collect->changed) {
+		index_save(collect);
+	}
+	LOG(LOG_INFO, "read %zu of %zu .desktop files", nr_unparsed,
+		nr_collected(collect));
+}
+
+static void
+collect_finish(struct collect *collect)
+{
+	struct app *app;
+	wl_array_for_each(app, &collect->apps) {
+		free_app(app);
+	}
+	wl_array_release(&collect->apps);
+	struct scan_dir *dir;
+	wl_array_for_each(dir, &collect->dirs) {
+		g_free(dir->path);
+		g_free(dir->prefix);
+	}
+	wl_array_release(&collect->dirs);
+	index_destroy(collect->index);
+}
+
+/* Sort the shown applications into one group per category */
+static void
+group_apps(struct collect *collect, GPtrArray *groups[NR_CATEGORIES])
+{
+	const char *env = getenv("XDG_CURRENT_DESKTOP");
+	char **desktops = env ? g_strsplit(env, ":", -1) : NULL;
+
+	/* Only the first file with a given id counts, even if it is hidden */
+	GHashTable *ids = g_hash_table_new(g_str_hash, g_str_equal);
+	for (size_t i = 0; i < NR_CATEGORIES; i++) {
+		groups[i] = g_ptr_array_new();
+	}
+	struct app *app;
+	wl_array_for_each(app, &collect->apps) {
+		if (g_hash_table_contains(ids, app->id)) {
+			continue;
+		}
+		g_hash_table_add(ids, app->id);
+		if (is_shown(app, desktops)) {
+			g_ptr_array_add(groups[category_of(app)], app);
+		}
+	}
+	g_hash_table_destroy(ids);
+	g_strfreev(desktops);
+
+	for (size_t i = 0; i < NR_CATEGORIES; i++) {
+		qsort(groups[i]->pdata, groups[i]->len, sizeof(gpointer),
+			compare_names);
+	}
+}
+
+static void
+fill_category(struct menu *menu, GPtrArray *group)
+{
+	for (guint i = 0; i < group->len; i++) {
+		struct app *app = group->pdata[i];
+		struct menuitem *entry = item_create(menu, app->name);
+		entry->icon = menu_strdup(app->icon);
+		entry->action = menu_strdup("Execute");
+		char *command = strip_field_codes(app->exec);
+		entry->command = menu_strdup(command);
+		g_free(command);
+	}
+}
+
+static char *
+category_menu_id(struct menu *menu, size_t category)
+{
+	const char *name = categories[category].name;
+	return g_strdup_printf("%s-%s", menu->id, name ? name : "Other");
+}
+
+static void
+add_category_item(struct menu *menu, size_t category, struct menu *submenu)
+{
+	struct menuitem *item = item_create(menu, categories[category].label);
+	item->icon = menu_strdup(categories[category].icon);
+	item->submenu = submenu;
+}
+
+struct menu *
+apps_menu_create(const char *id)
+{
+	struct collect collect = { 0 };
+	collect_apps(&collect);
+	GPtrArray *groups[NR_CATEGORIES];
+	group_apps(&collect, groups);
+
+	struct menu *menu = menu_create(id, "Applications", NULL);
+	for (size_t i = 0; i < NR_CATEGORIES; i++) {
+		if (groups[i]->len) {
+			char *submenu_id = category_menu_id(menu, i);
+			struct menu *submenu = menu_create(submenu_id,
+				categories[i].label, menu);
+			g_free(submenu_id);
+			add_category_item(menu, i, submenu);
+			fill_category(submenu, groups[i]);
+		}
+		g_ptr_array_free(groups[i], TRUE);
+	}
+	collect_finish(&collect);
+	return menu;
+}
+
+/*
+ * Replace the items of @menu with those built by @fill, which are allocated
+ * from a context of their own so that the old ones can be freed
+ */
+static void
+replace_items(struct menu *menu, void (*fill)(struct menu *menu, void *data),
+		void *data)
+{
+	TALLOC_CTX *content = talloc_new(menu);
+	menu_alloc_from(content);
+	struct menu *staging = menu_create(NULL, menu->label, menu->parent);
+	fill(staging, data);
+	menu_alloc_from(NULL);
+	if (menu_replace_items(menu, staging)) {
+		talloc_free(menu->content);
+		menu->content = content;
+		menu_items_added(menu);
+	} else {
+		talloc_free(content);
+	}
+}
+
+static void
+fill_group(struct menu *menu, void *data)
+{
+	fill_category(menu, data);
+}
+
+struct update {
+	struct menu *submenus[NR_CATEGORIES];
+};
+
+static void
+fill_root(struct menu *menu, void *data)
+{
+	struct update *update = data;
+	for (size_t i = 0; i < NR_CATEGORIES; i++) {
+		if (update->submenus[i]) {
+			add_category_item(menu, i, update->submenus[i]);
+		}
+	}
+}
+
+void
+apps_menu_update(struct menu *menu, const char **paths, size_t nr_paths)
+{
+	struct collect collect = {
+		.dirty = paths ? g_hash_table_new_full(g_str_hash, g_str_equal,
+			g_free, NULL) : NULL,
+		.all_dirty = !paths,
+	};
+	for (size_t i = 0; i < nr_paths; i++) {
+		/* A file written in place leaves its directory unchanged */
+		g_hash_table_add(collect.dirty, g_strdup(paths[i]));
+		g_hash_table_add(collect.dirty, g_path_get_dirname(paths[i]));
+	}
+	collect_apps(&collect);
+	GPtrArray *groups[NR_CATEGORIES];
+	group_apps(&collect, groups);
+
+	/*
+	 * Categories keep their menus, so only items of applications which
+	 * have been added, removed or changed are rendered again
+	 */
+	struct update update = { 0 };
+	for (size_t i = 0; i < NR_CATEGORIES; i++) {
+		char *id = category_menu_id(menu, i);
+		struct menu *submenu = get_menu_by_id(id);
+		if (groups[i]->len && !submenu) {
+			submenu = menu_create(id, categories[i].label, menu);
+			submenu->state = menu->state;
+		}
+		g_free(id);
+		if (submenu) {
+			replace_items(submenu, fill_group, groups[i]);
+		}
+		if (groups[i]->len) {
+			update.submenus[i] = submenu;
+		}
+		g_ptr_array_free(groups[i], TRUE);
+	}
+	replace_items(menu, fill_root, &update);
+
+	collect_finish(&collect);
+	if (collect.dirty) {
+		g_hash_table_destroy(collect.dirty);
+	}
+}
+
+static void
+update_stamp(const char *dir, void *data)
+{
+	int64_t *stamp = data;
+	struct stat st;
+	if (stat(dir, &st) || !S_ISDIR(st.st_mode)) {
+		return;
+	}
+	int64_t mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+	if (mtime > *stamp) {
+		*stamp = mtime;
+	}
+
+	DIR *d = opendir(dir);
+	if (!d) {
+		return;
+	}
+	struct dirent *entry;
+	while ((entry = readdir(d))) {
+		const char *name = entry->d_name;
+		if (name[0] == '.' || g_str_has_suffix(name, ".desktop")) {
+			continue;
+		}
+		char *path = g_build_filename(dir, name, NULL);
+		update_stamp(path, stamp);
+		g_free(path);
+	}
+	closedir(d);
+}
+
+int64_t
+apps_stamp(void)
+{
+	int64_t stamp = 0;
+	apps_for_each_dir(update_stamp, &stamp);
+	return stamp;
+}
@@ -0,0 +1,544 @@
+// SPDX-License-Identifier: GPL-2.0-only
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sway-client-helpers/log.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "apps.h"
+#include "cache.h"
+#include "catalog.h"
+#include "conf.h"
+#include "icon.h"
+#include "menu.h"
+#include "talloc-helpers.h"
+
+#define CACHE_MAGIC "TRAPPIST"
+#define CACHE_VERSION (8)
+
+/*
+ * A cache file consists of a header followed by an array of menus, an array
+ * of items, the translations of item labels (see catalog.h) and a string
+ * table. Menus and items refer to each other by index and to strings by
+ * offset, so the file can be used wherever it is mapped. String offset zero
+ * denotes NULL.
+ */
+struct cache_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t nr_menus;
+	uint32_t nr_items;
+	uint32_t nr_locales;
+	uint32_t nr_translations;
+	uint32_t strings_size;
+
+	/* menu.xml the cache was compiled from */
+	uint64_t source_size;
+	int64_t source_mtime_sec;
+	int64_t source_mtime_nsec;
+	uint64_t source_hash;
+
+	/* icon theme and size used to resolve icons */
+	uint64_t theme_hash;
+
+	/* apps_stamp() if the built-in application menu is included, else 0 */
+	int64_t apps_stamp;
+
+	/* icon_theme_stamp() if any item has an icon, else 0 */
+	int64_t icon_stamp;
+};
+
+struct cache_menu {
+	uint32_t id;
+	uint32_t label;
+	uint32_t execute;
+	int32_t ttl;
+	int32_t parent;
+	uint32_t first_item;
+	uint32_t nr_items;
+};
+
+enum cache_item_flags {
+	CACHE_ITEM_SELECTABLE = 1 << 0,
+};
+
+/* Items store their label as written, which is translated when loaded */
+struct cache_item {
+	uint32_t label;
+	uint32_t action;
+	uint32_t command;
+	uint32_t icon;
+	uint32_t icon_name;
+	int32_t submenu;
+	uint32_t flags;
+};
+
+static struct {
+	const char *data;
+	size_t size;
+	struct catalog_view translations;
+} map;
+
+/* FNV-1a */
+static uint64_t
+hash_bytes(uint64_t hash, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	for (size_t i = 0; i < len; i++) {
+		hash ^= p[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+#define HASH_INIT (0xcbf29ce484222325ULL)
+
+static uint64_t
+hash_string(uint64_t hash, const char *s)
+{
+	return hash_bytes(hash, s, s ? strlen(s) + 1 : 0);
+}
+
+static uint64_t
+theme_hash(struct conf *conf)
+{
+	uint64_t hash = hash_string(HASH_INIT, conf->icon.theme);
+	return hash_bytes(hash, &conf->icon.size, sizeof(conf->icon.size));
+}
+
+static bool
+hash_file(const char *filename, size_t size, uint64_t *hash)
+{
+	int fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return false;
+	}
+	void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		return false;
+	}
+	*hash = hash_bytes(HASH_INIT, data, size);
+	munmap(data, size);
+	return true;
+}
+
+static char *
+cache_dir(TALLOC_CTX *ctx)
+{
+	const char *cache_home = getenv("XDG_CACHE_HOME");
+	if (cache_home && *cache_home) {
+		return talloc_asprintf(ctx, "%s/trappist", cache_home);
+	}
+	const char *home = getenv("HOME");
+	if (!home) {
+		return NULL;
+	}
+	return talloc_asprintf(ctx, "%s/.cache/trappist", home);
+}
+
+/* One cache file per menu file, named after a hash of its absolute path */
+static char *
+cache_path(TALLOC_CTX *ctx, const char *menu_file)
+{
+	char *dir = cache_dir(ctx);
+	char *abspath = realpath(menu_file, NULL);
+	if (!dir || !abspath) {
+		free(abspath);
+		return NULL;
+	}
+	uint64_t hash = hash_string(HASH_INIT, abspath);
+	free(abspath);
+	return talloc_asprintf(ctx, "%s/menu-%016llx.cache", dir,
+		(unsigned long long)hash);
+}
+
+static bool
+cache_valid(const struct cache_header *header, size_t size,
+		const char *menu_file, struct conf *conf)
+{
+	if (memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic))
+			|| header->version != CACHE_VERSION) {
+		return false;
+	}
+	uint64_t expected = sizeof(*header)
+		+ (uint64_t)header->nr_menus * sizeof(struct cache_menu)
+		+ (uint64_t)header->nr_items * sizeof(struct cache_item)
+		+ (uint64_t)header->nr_locales * sizeof(uint32_t)
+		+ (uint64_t)header->nr_translations
+			* sizeof(struct catalog_entry)
+		+ header->strings_size;
+	if (expected != size || !header->strings_size) {
+		LOG(LOG_ERROR, "corrupt menu cache");
+		return false;
+	}
+	if (header->theme_hash != theme_hash(conf)) {
+		LOG(LOG_DEBUG, "menu cache compiled for another icon theme");
+		return false;
+	}
+	if (header->apps_stamp && header->apps_stamp != apps_stamp()) {
+		LOG(LOG_DEBUG, "applications have changed since menu cache");
+		return false;
+	}
+	if (header->icon_stamp && header->icon_stamp != icon_theme_stamp()) {
+		LOG(LOG_DEBUG, "icon theme has changed since menu cache");
+		return false;
+	}
+
+	struct stat st;
+	if (stat(menu_file, &st) || (uint64_t)st.st_size != header->source_size) {
+		return false;
+	}
+	if (st.st_mtim.tv_sec == header->source_mtime_sec
+			&& st.st_mtim.tv_nsec == header->source_mtime_nsec) {
+		return true;
+	}
+
+	/* Only hash the file if it has been touched */
+	uint64_t hash;
+	if (!hash_file(menu_file, st.st_size, &hash)) {
+		return false;
+	}
+	return hash == header->source_hash;
+}
+
+/* Check every index and offset before any menu is built */
+static bool
+cache_records_valid(const struct cache_header *header,
+		const struct cache_menu *menus, const struct cache_item *items,
+		const char *strings)
+{
+	uint32_t nr_strings = header->strings_size;
+	if (strings[0] || strings[nr_strings - 1]) {
+		return false;
+	}
+	for (uint32_t i = 0; i < header->nr_menus; i++) {
+		const struct cache_menu *m = &menus[i];
+		if (m->id >= nr_strings || m->label >= nr_strings
+				|| m->execute >= nr_strings
+				|| m->parent >= (int32_t)header->nr_menus
+				|| m->first_item > header->nr_items
+				|| m->nr_items > header->nr_items - m->first_item) {
+			return false;
+		}
+	}
+	for (uint32_t i = 0; i < header->nr_items; i++) {
+		const struct cache_item *item = &items[i];
+		if (item->label >= nr_strings || item->action >= nr_strings
+				|| item->command >= nr_strings
+				|| item->icon >= nr_strings
+				|| item->icon_name >= nr_strings
+				|| item->submenu >= (int32_t)header->nr_menus) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static char *
+cache_string(uint32_t offset)
+{
+	const struct cache_header *header = (const void *)map.data;
+	const char *strings = map.data + map.size - header->strings_size;
+	return offset ? (char *)strings + offset : NULL;
+}
+
+/* Translated labels point into the cache too, so loading copies nothing */
+static void
+load_label(struct menuitem *item, uint32_t label)
+{
+	uint32_t text = catalog_view_translate(&map.translations, label);
+	item->label = cache_string(text);
+	item->label_id = text != label ? cache_string(label) : NULL;
+}
+
+static void
+build_menus(const struct cache_header *header,
+		const struct cache_menu *menus, const struct cache_item *items)
+{
+	int base = menu_count();
+	for (uint32_t i = 0; i < header->nr_menus; i++) {
+		struct menu *menu = menu_create(NULL, NULL, NULL);
+		menu->id = cache_string(menus[i].id);
+		menu->label = cache_string(menus[i].label);
+		menu->execute = cache_string(menus[i].execute);
+		menu->ttl = menus[i].ttl;
+		menu_index_id(menu);
+	}
+	for (uint32_t i = 0; i < header->nr_menus; i++) {
+		const struct cache_menu *m = &menus[i];
+		struct menu *menu = menu_get(base + i);
+		if (m->parent >= 0) {
+			menu->parent = menu_get(base + m->parent);
+		}
+		for (uint32_t j = 0; j < m->nr_items; j++) {
+			const struct cache_item *ci = &items[m->first_item + j];
+			struct menuitem *item;
+			if (ci->flags & CACHE_ITEM_SELECTABLE) {
+				item = item_create(menu, NULL);
+				load_label(item, ci->label);
+			} else {
+				item = separator_create(menu, NULL);
+			}
+			item->action = cache_string(ci->action);
+			item->command = cache_string(ci->command);
+			item->icon = cache_string(ci->icon);
+			item->icon_name = cache_string(ci->icon_name);
+			if (ci->submenu >= 0) {
+				item->submenu = menu_get(base + ci->submenu);
+			}
+		}
+	}
+}
+
+bool
+cache_load(const char *menu_file, struct conf *conf)
+{
+	TALLOC_CTX *tal defer = xtalloc_new(NULL);
+	char *path = cache_path(tal, menu_file);
+	if (!path) {
+		return false;
+	}
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) || (size_t)st.st_size < sizeof(struct cache_header)) {
+		close(fd);
+		return false;
+	}
+	void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		return false;
+	}
+
+	const struct cache_header *header = data;
+	if (!cache_valid(header, st.st_size, menu_file, conf)) {
+		munmap(data, st.st_size);
+		return false;
+	}
+	const struct cache_menu *menus = (const void *)(header + 1);
+	const struct cache_item *items = (const void *)(menus + header->nr_menus);
+	const uint32_t *locales = (const void *)(items + header->nr_items);
+	const struct catalog_entry *translations =
+		(const void *)(locales + header->nr_locales);
+	const char *strings = (const char *)(translations
+		+ header->nr_translations);
+	struct catalog_view view;
+	if (!cache_records_valid(header, menus, items, strings)
+			|| !catalog_view_init(&view, locales, header->nr_locales,
+				translations, header->nr_translations, strings,
+				header->strings_size)) {
+		LOG(LOG_ERROR, "corrupt menu cache");
+		munmap(data, st.st_size);
+		return false;
+	}
+
+	map.data = data;
+	map.size = st.st_size;
+	map.translations = view;
+	build_menus(header, menus, items);
+	LOG(LOG_DEBUG, "loaded %u menus from cache '%s'", header->nr_menus,
+		path);
+	return true;
+}
+
+uint32_t
+cache_intern(GHashTable *offsets, struct wl_array *strings, const char *s)
+{
+	if (!s) {
+		return 0;
+	}
+	gpointer offset = g_hash_table_lookup(offsets, s);
+	if (offset) {
+		return GPOINTER_TO_UINT(offset);
+	}
+	size_t len = strlen(s) + 1;
+	uint32_t pos = strings->size;
+	memcpy(wl_array_add(strings, len), s, len);
+	g_hash_table_insert(offsets, (gpointer)s, GUINT_TO_POINTER(pos));
+	return pos;
+}
+
+static bool
+mkdir_p(const char *dir)
+{
+	char *path = strdup(dir);
+	for (char *p = path + 1; *p; p++) {
+		if (*p != '/') {
+			continue;
+		}
+		*p = '\0';
+		mkdir(path, 0755);
+		*p = '/';
+	}
+	bool ret = !mkdir(path, 0755) || errno == EEXIST;
+	free(path);
+	return ret;
+}
+
+static bool
+write_file(const char *path, const void *data, size_t size)
+{
+	FILE *fp = fopen(path, "wb");
+	if (!fp) {
+		return false;
+	}
+	bool ret = fwrite(data, 1, size, fp) == size;
+	return !fclose(fp) && ret;
+}
+
+char *
+cache_file_path(TALLOC_CTX *ctx, const char *name)
+{
+	char *dir = cache_dir(ctx);
+	return dir ? talloc_asprintf(ctx, "%s/%s", dir, name) : NULL;
+}
+
+bool
+cache_write_file(const char *path, const void *data, size_t size)
+{
+	TALLOC_CTX *tal defer = xtalloc_new(NULL);
+	char *dir = talloc_strdup(tal, path);
+	char *slash = strrchr(dir, '/');
+	if (slash) {
+		*slash = '\0';
+	}
+
+	/* Write to a temporary file and rename so readers never see half */
+	char *tmp = talloc_asprintf(tal, "%s.%d", path, getpid());
+	if (!mkdir_p(dir) || !write_file(tmp, data, size)
+			|| rename(tmp, path)) {
+		unlink(tmp);
+		return false;
+	}
+	return true;
+}
+
+void
+cache_save(const char *menu_file, struct conf *conf)
+{
+	TALLOC_CTX *tal defer = xtalloc_new(NULL);
+	char *path = cache_path(tal, menu_file);
+	struct stat st;
+	if (!path || stat(menu_file, &st)) {
+		return;
+	}
+
+	struct cache_header header = {
+		.version = CACHE_VERSION,
+		.source_size = st.st_size,
+		.source_mtime_sec = st.st_mtim.tv_sec,
+		.source_mtime_nsec = st.st_mtim.tv_nsec,
+		.theme_hash = theme_hash(conf),
+		.apps_stamp = get_menu_by_id(APPS_MENU_ID) ? apps_stamp() : 0,
+	};
+	memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+	if (!hash_file(menu_file, st.st_size, &header.source_hash)) {
+		return;
+	}
+
+	struct wl_array buf, items, locales, translations, strings;
+	wl_array_init(&buf);
+	wl_array_init(&items);
+	wl_array_init(&locales);
+	wl_array_init(&translations);
+	wl_array_init(&strings);
+	GHashTable *offsets = g_hash_table_new(g_str_hash, g_str_equal);
+	GHashTable *labels = g_hash_table_new(g_str_hash, g_str_equal);
+	*(char *)wl_array_add(&strings, 1) = '\0';
+
+	wl_array_add(&buf, sizeof(header));
+	bool have_icons = false;
+	int nr_menus = menu_count();
+	for (int i = 0; i < nr_menus; i++) {
+		struct menu *menu = menu_get(i);
+		struct cache_menu *m = wl_array_add(&buf, sizeof(*m));
+		m->id = cache_intern(offsets, &strings, menu->id);
+		m->label = cache_intern(offsets, &strings, menu->label);
+		m->execute = cache_intern(offsets, &strings, menu->execute);
+		m->ttl = menu->ttl;
+		m->parent = menu->parent ? menu->parent->index : -1;
+		m->first_item = items.size / sizeof(struct cache_item);
+		m->nr_items = 0;
+
+		/* Items of a pipemenu are its output, which is fetched again */
+		if (menu->execute) {
+			continue;
+		}
+
+		/* menu->menuitems is in reverse order */
+		struct menuitem *item;
+		wl_list_for_each_reverse(item, &menu->menuitems, link) {
+			/* Windows come and go, see toplevels_menu_fill() */
+			if (item->toplevel) {
+				continue;
+			}
+			struct cache_item *ci = wl_array_add(&items, sizeof(*ci));
+			const char *label = item->label_id ? item->label_id
+				: item->label;
+			ci->label = cache_intern(offsets, &strings, label);
+			if (label) {
+				g_hash_table_add(labels, (gpointer)label);
+			}
+			ci->action = cache_intern(offsets, &strings, item->action);
+			ci->command = cache_intern(offsets, &strings, item->command);
+			ci->icon = cache_intern(offsets, &strings, item->icon);
+			ci->icon_name = cache_intern(offsets, &strings,
+				item->icon_name);
+			have_icons |= item->icon || item->icon_name;
+			ci->submenu = item->submenu ? item->submenu->index : -1;
+			ci->flags = item->selectable ? CACHE_ITEM_SELECTABLE : 0;
+			m->nr_items++;
+		}
+	}
+	catalog_write(labels, map.data ? &map.translations : NULL, &locales,
+		&translations, offsets, &strings);
+	header.icon_stamp = have_icons ? icon_theme_stamp() : 0;
+	header.nr_menus = nr_menus;
+	header.nr_items = items.size / sizeof(struct cache_item);
+	header.nr_locales = locales.size / sizeof(uint32_t);
+	header.nr_translations = translations.size
+		/ sizeof(struct catalog_entry);
+	header.strings_size = strings.size;
+	memcpy(buf.data, &header, sizeof(header));
+	memcpy(wl_array_add(&buf, items.size), items.data, items.size);
+	memcpy(wl_array_add(&buf, locales.size), locales.data, locales.size);
+	memcpy(wl_array_add(&buf, translations.size), translations.data,
+		translations.size);
+	memcpy(wl_array_add(&buf, strings.size), strings.data, strings.size);
+
+	if (!cache_write_file(path, buf.data, buf.size)) {
+		LOG_ERRNO(LOG_ERROR, "cannot write menu cache '%s'", path);
+	} else {
+		LOG(LOG_DEBUG, "wrote menu cache '%s'", path);
+	}
+
+	g_hash_table_destroy(offsets);
+	g_hash_table_destroy(labels);
+	wl_array_release(&buf);
+	wl_array_release(&items);
+	wl_array_release(&locales);
+	wl_array_release(&translations);
+	wl_array_release(&strings);
+}
+
+void
+cache_finish(void)
+{
+	if (map.data) {
+		munmap((void *)map.data, map.size);
+	}
+	map.data = NULL;
+	map.size = 0;
+	map.translations = (struct catalog_view){ 0 };
+}
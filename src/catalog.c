@@ -0,0 +1,350 @@
+// SPDX-License-Identifier: GPL-2.0-only
+#define _POSIX_C_SOURCE 200809L
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cache.h"
+#include "catalog.h"
+
+struct translation {
+	const char *locale;
+	const char *text;
+	enum catalog_source source;
+};
+
+/* Interned strings of the catalog, which stay put until catalog_finish() */
+static GStringChunk *chunk;
+
+/* msgid -> GArray of struct translation */
+static GHashTable *catalog;
+
+static char *locale_names[CATALOG_MAX_LOCALES];
+static size_t nr_locale_names;
+static bool have_locale_names;
+
+static void
+add_locale_name(char *name)
+{
+	locale_names[nr_locale_names++] = name;
+}
+
+/*
+ * The locale for messages is lang_COUNTRY.ENCODING@MODIFIER. Its names are
+ * tried in the order given by the desktop entry spec.
+ */
+static void
+init_locale_names(void)
+{
+	if (have_locale_names) {
+		return;
+	}
+	have_locale_names = true;
+	const char *env = NULL;
+	const char *vars[] = { "LC_ALL", "LC_MESSAGES", "LANG" };
+	for (size_t i = 0; i < sizeof(vars) / sizeof(*vars) && !env; i++) {
+		env = getenv(vars[i]);
+		env = env && *env ? env : NULL;
+	}
+	if (!env) {
+		return;
+	}
+	char *lang = g_strdup(env);
+	char *modifier = strchr(lang, '@');
+	if (modifier) {
+		*modifier++ = '\0';
+	}
+	char *encoding = strchr(lang, '.');
+	if (encoding) {
+		*encoding = '\0';
+	}
+	char *country = strchr(lang, '_');
+	if (country) {
+		*country++ = '\0';
+	}
+	if (*lang && strcmp(lang, "C") && strcmp(lang, "POSIX")) {
+		if (country && modifier) {
+			add_locale_name(g_strdup_printf("%s_%s@%s", lang,
+				country, modifier));
+		}
+		if (country) {
+			add_locale_name(g_strdup_printf("%s_%s", lang, country));
+		}
+		if (modifier) {
+			add_locale_name(g_strdup_printf("%s@%s", lang, modifier));
+		}
+		add_locale_name(g_strdup(lang));
+	}
+	g_free(lang);
+}
+
+static void
+free_translations(gpointer data)
+{
+	g_array_free(data, TRUE);
+}
+
+void
+catalog_add(const char *msgid, const char *locale, const char *text,
+		enum catalog_source source)
+{
+	if (!catalog) {
+		chunk = g_string_chunk_new(4096);
+		catalog = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+			free_translations);
+	}
+	msgid = g_string_chunk_insert_const(chunk, msgid);
+	locale = g_string_chunk_insert_const(chunk, locale);
+	text = g_string_chunk_insert_const(chunk, text);
+	GArray *translations = g_hash_table_lookup(catalog, msgid);
+	if (!translations) {
+		translations = g_array_new(FALSE, FALSE,
+			sizeof(struct translation));
+		g_hash_table_insert(catalog, (gpointer)msgid, translations);
+	}
+
+	/* Interned, so equal locales are the same pointer */
+	for (guint i = 0; i < translations->len; i++) {
+		struct translation *t = &g_array_index(translations,
+			struct translation, i);
+		if (t->locale == locale && t->source == source) {
+			t->text = text;
+			return;
+		}
+	}
+	struct translation t = {
+		.locale = locale,
+		.text = text,
+		.source = source,
+	};
+	g_array_append_val(translations, t);
+}
+
+void
+catalog_drop_menu_file(void)
+{
+	if (!catalog) {
+		return;
+	}
+	GHashTableIter iter;
+	gpointer value;
+	g_hash_table_iter_init(&iter, catalog);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		GArray *translations = value;
+		for (guint i = translations->len; i-- > 0;) {
+			if (g_array_index(translations, struct translation,
+					i).source == CATALOG_MENU_FILE) {
+				g_array_remove_index_fast(translations, i);
+			}
+		}
+		if (!translations->len) {
+			g_hash_table_iter_remove(&iter);
+		}
+	}
+}
+
+/* Translation into @locale, preferring that of a menu file, or NULL */
+static struct translation *
+find_translation(GArray *translations, const char *locale)
+{
+	struct translation *found = NULL;
+	for (guint i = 0; translations && i < translations->len; i++) {
+		struct translation *t = &g_array_index(translations,
+			struct translation, i);
+		if (!strcmp(t->locale, locale) && (!found
+				|| t->source == CATALOG_MENU_FILE)) {
+			found = t;
+		}
+	}
+	return found;
+}
+
+const char *
+catalog_translate(const char *msgid)
+{
+	GArray *translations = catalog && msgid
+		? g_hash_table_lookup(catalog, msgid) : NULL;
+	if (!translations) {
+		return msgid;
+	}
+	init_locale_names();
+	for (size_t i = 0; i < nr_locale_names; i++) {
+		struct translation *t = find_translation(translations,
+			locale_names[i]);
+		if (t) {
+			return t->text;
+		}
+	}
+	return msgid;
+}
+
+static int
+compare_entries(const void *a, const void *b)
+{
+	const struct catalog_entry *x = a, *y = b;
+	if (x->msgid != y->msgid) {
+		return x->msgid < y->msgid ? -1 : 1;
+	}
+	if (x->locale != y->locale) {
+		return x->locale < y->locale ? -1 : 1;
+	}
+	return 0;
+}
+
+static void
+write_entry(struct wl_array *locales, struct wl_array *entries,
+		GHashTable *offsets, struct wl_array *strings, GHashTable *seen,
+		uint32_t msgid, const char *locale, const char *text)
+{
+	struct catalog_entry *e = wl_array_add(entries, sizeof(*e));
+	*e = (struct catalog_entry){
+		.msgid = msgid,
+		.locale = cache_intern(offsets, strings, locale),
+		.text = cache_intern(offsets, strings, text),
+	};
+	gpointer key = GUINT_TO_POINTER(e->locale);
+	if (!g_hash_table_contains(seen, key)) {
+		g_hash_table_add(seen, key);
+		*(uint32_t *)wl_array_add(locales, sizeof(uint32_t)) = e->locale;
+	}
+}
+
+void
+catalog_write(GHashTable *msgids, const struct catalog_view *mapped,
+		struct wl_array *locales, struct wl_array *entries,
+		GHashTable *offsets, struct wl_array *strings)
+{
+	GHashTable *seen = g_hash_table_new(NULL, NULL);
+	GHashTableIter iter;
+	gpointer key;
+	g_hash_table_iter_init(&iter, msgids);
+	while (g_hash_table_iter_next(&iter, &key, NULL)) {
+		const char *s = key;
+		GArray *translations = catalog
+			? g_hash_table_lookup(catalog, s) : NULL;
+		const struct catalog_entry *first = NULL;
+		size_t n = 0;
+		if (mapped && s > mapped->strings
+				&& s < mapped->strings + mapped->strings_size) {
+			n = catalog_view_find(mapped, s - mapped->strings,
+				&first);
+		}
+		if (!translations && !n) {
+			continue;
+		}
+		uint32_t msgid = cache_intern(offsets, strings, s);
+		for (guint i = 0; translations && i < translations->len; i++) {
+			struct translation *t = &g_array_index(translations,
+				struct translation, i);
+			if (find_translation(translations, t->locale) == t) {
+				write_entry(locales, entries, offsets, strings,
+					seen, msgid, t->locale, t->text);
+			}
+		}
+		for (size_t i = 0; i < n; i++) {
+			const char *locale = mapped->strings + first[i].locale;
+			if (!find_translation(translations, locale)) {
+				write_entry(locales, entries, offsets, strings,
+					seen, msgid, locale,
+					mapped->strings + first[i].text);
+			}
+		}
+	}
+	g_hash_table_destroy(seen);
+	qsort(entries->data, entries->size / sizeof(struct catalog_entry),
+		sizeof(struct catalog_entry), compare_entries);
+}
+
+bool
+catalog_view_init(struct catalog_view *view, const uint32_t *locales,
+		size_t nr_locales, const struct catalog_entry *entries,
+		size_t nr_entries, const char *strings, size_t strings_size)
+{
+	*view = (struct catalog_view){
+		.entries = entries,
+		.nr_entries = nr_entries,
+		.strings = strings,
+		.strings_size = strings_size,
+	};
+	for (size_t i = 0; i < nr_locales; i++) {
+		if (!locales[i] || locales[i] >= strings_size) {
+			return false;
+		}
+	}
+	for (size_t i = 0; i < nr_entries; i++) {
+		const struct catalog_entry *e = &entries[i];
+		if (!e->msgid || e->msgid >= strings_size || !e->locale
+				|| e->locale >= strings_size || !e->text
+				|| e->text >= strings_size) {
+			return false;
+		}
+		if (i && compare_entries(&entries[i - 1], e) >= 0) {
+			return false;
+		}
+	}
+
+	init_locale_names();
+	for (size_t i = 0; i < nr_locale_names; i++) {
+		for (size_t j = 0; j < nr_locales; j++) {
+			if (!strcmp(strings + locales[j], locale_names[i])) {
+				view->locales[view->nr_locales++] = locales[j];
+				break;
+			}
+		}
+	}
+	return true;
+}
+
+uint32_t
+catalog_view_translate(const struct catalog_view *view, uint32_t msgid)
+{
+	for (size_t i = 0; i < view->nr_locales; i++) {
+		struct catalog_entry key = {
+			.msgid = msgid,
+			.locale = view->locales[i],
+		};
+		const struct catalog_entry *e = bsearch(&key, view->entries,
+			view->nr_entries, sizeof(key), compare_entries);
+		if (e) {
+			return e->text;
+		}
+	}
+	return msgid;
+}
+
+size_t
+catalog_view_find(const struct catalog_view *view, uint32_t msgid,
+		const struct catalog_entry **first)
+{
+	size_t lo = 0, hi = view->nr_entries;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (view->entries[mid].msgid < msgid) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	size_t n = 0;
+	while (lo + n < view->nr_entries
+			&& view->entries[lo + n].msgid == msgid) {
+		n++;
+	}
+	*first = view->entries + lo;
+	return n;
+}
+
+void
+catalog_finish(void)
+{
+	if (catalog) {
+		g_hash_table_destroy(catalog);
+		g_string_chunk_free(chunk);
+	}
+	catalog = NULL;
+	chunk = NULL;
+	for (size_t i = 0; i < nr_locale_names; i++) {
+		g_free(locale_names[i]);
+	}
+	nr_locale_names = 0;
+	have_locale_names = false;
+}
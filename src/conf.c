@@ -7,7 +7,13 @@
 static void
 set_default_values(struct conf *conf)
 {
+	conf->icon.theme = strdup("Papirus");
 	conf->icon.size = 22;
+	conf->pipemenu.timeout = 5000;
+	conf->pipemenu.ttl = 0;
+	conf->pipemenu.prefetch = PIPEMENU_PREFETCH_HOVER;
+	conf->pipemenu.jobs = 4;
+	conf->daemon.budget = 0;
 }
 
 static int
@@ -18,6 +24,31 @@ handler(void *user, const char *section, const char *name, const char *value)
 	if (!strcmp(section, "icon")) {
 		if (!strcmp(name, "size")) {
 			conf->icon.size = atoi(value);
+		} else if (!strcmp(name, "theme")) {
+			free(conf->icon.theme);
+			conf->icon.theme = strdup(value);
+		}
+	} else if (!strcmp(section, "pipemenu")) {
+		if (!strcmp(name, "timeout")) {
+			conf->pipemenu.timeout = atoi(value);
+		} else if (!strcmp(name, "ttl")) {
+			conf->pipemenu.ttl = atoi(value);
+		} else if (!strcmp(name, "prefetch")) {
+			if (!strcmp(value, "none")) {
+				conf->pipemenu.prefetch = PIPEMENU_PREFETCH_NONE;
+			} else if (!strcmp(value, "hover")) {
+				conf->pipemenu.prefetch = PIPEMENU_PREFETCH_HOVER;
+			} else if (!strcmp(value, "startup")) {
+				conf->pipemenu.prefetch = PIPEMENU_PREFETCH_STARTUP;
+			} else {
+				LOG(LOG_ERROR, "unknown prefetch value: %s", value);
+			}
+		} else if (!strcmp(name, "jobs")) {
+			conf->pipemenu.jobs = atoi(value);
+		}
+	} else if (!strcmp(section, "daemon")) {
+		if (!strcmp(name, "budget")) {
+			conf->daemon.budget = atoi(value);
 		}
 	} else {
 		LOG(LOG_ERROR, "unknown config section: %s", section);
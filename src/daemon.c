@@ -0,0 +1,304 @@
+// SPDX-License-Identifier: GPL-2.0-only
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sway-client-helpers/log.h>
+#include <sway-client-helpers/loop.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "conf.h"
+#include "daemon.h"
+#include "icon.h"
+#include "menu.h"
+#include "trappist.h"
+
+/* Longest command line accepted, including the newline */
+#define DAEMON_MAX_COMMAND (256)
+
+/* Time in ms a client has to send its command before it is hung up on */
+#define DAEMON_CLIENT_TIMEOUT (1000)
+
+struct client {
+	struct state *state;
+	int fd;
+	struct loop_timer *timer;
+	char buf[DAEMON_MAX_COMMAND];
+	size_t len;
+};
+
+static int listen_fd = -1;
+static struct sockaddr_un addr;
+static struct conf *daemon_conf;
+
+static bool
+socket_address(struct sockaddr_un *sun)
+{
+	const char *dir = getenv("XDG_RUNTIME_DIR");
+	if (!dir || !*dir) {
+		LOG(LOG_ERROR, "XDG_RUNTIME_DIR is not set");
+		return false;
+	}
+	const char *display = getenv("WAYLAND_DISPLAY");
+	if (!display || !*display) {
+		display = "wayland-0";
+	}
+	const char *slash = strrchr(display, '/');
+	if (slash) {
+		display = slash + 1;
+	}
+	*sun = (struct sockaddr_un){ .sun_family = AF_UNIX };
+	int len = snprintf(sun->sun_path, sizeof(sun->sun_path),
+		"%s/trappist-%s.sock", dir, display);
+	if (len < 0 || (size_t)len >= sizeof(sun->sun_path)) {
+		LOG(LOG_ERROR, "socket path too long");
+		return false;
+	}
+	return true;
+}
+
+/* Connect to the daemon at @sun, returning the socket or -1 */
+static int
+connect_to(const struct sockaddr_un *sun)
+{
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		return -1;
+	}
+	if (connect(fd, (const struct sockaddr *)sun, sizeof(*sun))) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Hide the menu if @id, or any menu if NULL, is shown, or else show it */
+static void
+toggle(struct state *state, const char *id, const char *output)
+{
+	bool shown = state->surface->layer_surface;
+	if (shown && (!id || (state->menu->id
+			&& !strcmp(id, state->menu->id)))) {
+		menu_hide(state);
+	} else {
+		menu_show(state, id, output, -1, -1);
+	}
+}
+
+static void
+run_command(struct state *state, char *command)
+{
+	/* The output to show the menu on comes last, as "@<name>" */
+	const char *output = NULL;
+	char *at = strstr(command, " @");
+	if (at) {
+		*at = '\0';
+		output = at + 2;
+	}
+
+	char id[DAEMON_MAX_COMMAND];
+	int x, y;
+	if (!strcmp(command, "show")) {
+		menu_show(state, NULL, output, -1, -1);
+	} else if (sscanf(command, "show %d %d", &x, &y) == 2) {
+		menu_show(state, NULL, output, x, y);
+	} else if (sscanf(command, "show %s %d %d", id, &x, &y) == 3) {
+		menu_show(state, id, output, x, y);
+	} else if (sscanf(command, "show %s", id) == 1) {
+		menu_show(state, id, output, -1, -1);
+	} else if (!strcmp(command, "hide")) {
+		menu_hide(state);
+	} else if (!strcmp(command, "toggle")) {
+		toggle(state, NULL, output);
+	} else if (sscanf(command, "toggle %s", id) == 1) {
+		toggle(state, id, output);
+	} else {
+		LOG(LOG_ERROR, "unknown command '%s'", command);
+	}
+}
+
+static void
+client_destroy(struct client *client)
+{
+	if (client->timer) {
+		loop_remove_timer(client->state->eventloop, client->timer);
+	}
+	loop_remove_fd(client->state->eventloop, client->fd);
+	close(client->fd);
+	free(client);
+}
+
+/* The command is run once its line is complete, or the client hangs up */
+static void
+handle_client(int fd, short mask, void *data)
+{
+	struct client *client = data;
+	ssize_t len = read(fd, client->buf + client->len,
+		sizeof(client->buf) - 1 - client->len);
+	if (len < 0 && (errno == EAGAIN || errno == EINTR)) {
+		return;
+	}
+	if (len > 0) {
+		client->len += len;
+	}
+	client->buf[client->len] = '\0';
+	char *newline = strchr(client->buf, '\n');
+	if (!newline && len > 0 && client->len < sizeof(client->buf) - 1) {
+		return;
+	}
+	if (newline) {
+		*newline = '\0';
+	}
+	if (newline || (len == 0 && client->len)) {
+		run_command(client->state, client->buf);
+	} else if (len != 0) {
+		LOG(LOG_ERROR, "bad command on socket");
+	}
+	client_destroy(client);
+}
+
+static void
+handle_client_timeout(void *data)
+{
+	struct client *client = data;
+	client->timer = NULL;
+	LOG(LOG_ERROR, "no command on socket");
+	client_destroy(client);
+}
+
+static void
+handle_connection(int fd, short mask, void *data)
+{
+	struct state *state = data;
+	int client_fd = accept(fd, NULL, NULL);
+	if (client_fd < 0) {
+		return;
+	}
+	struct client *client = calloc(1, sizeof(*client));
+	if (!client) {
+		close(client_fd);
+		return;
+	}
+	client->state = state;
+	client->fd = client_fd;
+	fcntl(client_fd, F_SETFD, FD_CLOEXEC);
+	fcntl(client_fd, F_SETFL, O_NONBLOCK);
+	loop_add_fd(state->eventloop, client_fd, POLLIN, handle_client, client);
+	client->timer = loop_add_timer(state->eventloop, DAEMON_CLIENT_TIMEOUT,
+		handle_client_timeout, client);
+}
+
+bool
+daemon_init(struct state *state, struct conf *conf)
+{
+	daemon_conf = conf;
+	if (!socket_address(&addr)) {
+		return false;
+	}
+	int fd = connect_to(&addr);
+	if (fd >= 0) {
+		close(fd);
+		LOG(LOG_ERROR, "trappist is already running on '%s'",
+			addr.sun_path);
+		return false;
+	}
+
+	/* Nobody is listening, so the socket was left by a daemon that died */
+	unlink(addr.sun_path);
+	listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&addr,
+			sizeof(addr)) || listen(listen_fd, 4)) {
+		LOG_ERRNO(LOG_ERROR, "cannot listen on '%s'", addr.sun_path);
+		if (listen_fd >= 0) {
+			close(listen_fd);
+			listen_fd = -1;
+		}
+		return false;
+	}
+	loop_add_fd(state->eventloop, listen_fd, POLLIN, handle_connection,
+		state);
+	LOG(LOG_INFO, "listening on '%s'", addr.sun_path);
+	return true;
+}
+
+bool
+daemon_send(const char *command)
+{
+	struct sockaddr_un sun;
+	if (!socket_address(&sun)) {
+		return false;
+	}
+	int fd = connect_to(&sun);
+	if (fd < 0) {
+		LOG(LOG_ERROR, "trappist is not running on '%s'", sun.sun_path);
+		return false;
+	}
+	size_t len = strlen(command);
+	bool ok = write(fd, command, len) == (ssize_t)len
+		&& write(fd, "\n", 1) == 1;
+	close(fd);
+	return ok;
+}
+
+/* Resident set size in KiB, or -1 if it cannot be read */
+static long
+resident_size(void)
+{
+	FILE *fp = fopen("/proc/self/statm", "r");
+	if (!fp) {
+		return -1;
+	}
+	long size, resident;
+	int n = fscanf(fp, "%ld %ld", &size, &resident);
+	fclose(fp);
+	return n == 2 ? resident * (sysconf(_SC_PAGESIZE) / 1024) : -1;
+}
+
+/* Give memory freed by the menu back to the system */
+static void
+trim_heap(void)
+{
+#ifdef __GLIBC__
+	malloc_trim(0);
+#endif
+}
+
+void
+daemon_trim(struct state *state)
+{
+	trim_heap();
+	long resident = resident_size();
+	long budget = daemon_conf ? daemon_conf->daemon.budget * 1024L : 0;
+	if (budget > 0 && resident > budget) {
+		LOG(LOG_INFO, "%ld KiB resident is over the budget of %ld KiB",
+			resident, budget);
+		menu_drop_caches(state);
+		icon_theme_release();
+		trim_heap();
+		resident = resident_size();
+		if (resident > budget) {
+			LOG(LOG_ERROR, "%ld KiB resident while hidden, over the "
+				"budget of %ld KiB", resident, budget);
+		}
+	}
+	LOG(LOG_INFO, "hidden with %ld KiB resident", resident);
+}
+
+void
+daemon_finish(struct state *state)
+{
+	if (listen_fd < 0) {
+		return;
+	}
+	loop_remove_fd(state->eventloop, listen_fd);
+	close(listen_fd);
+	unlink(addr.sun_path);
+	listen_fd = -1;
+}
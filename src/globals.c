@@ -1,6 +1,8 @@
 // SPDX-License-Identifier: GPL-2.0-only
 #include <sway-client-helpers/log.h>
+#include "toplevels.h"
 #include "trappist.h"
+#include "wlr-foreign-toplevel-management-unstable-v1-client-protocol.h"
 #include "wlr-layer-shell-unstable-v1-client-protocol.h"
 
 static void
@@ -28,7 +30,10 @@ handle_wl_registry_global(void *data, struct wl_registry *registry,
 	} else if (!strcmp(interface, wl_output_interface.name)) {
 		struct wl_output *wl_output = wl_registry_bind(registry, name,
 				&wl_output_interface, 4);
-		output_init(state, wl_output);
+		output_init(state, wl_output, name);
+	} else if (!strcmp(interface,
+			zwlr_foreign_toplevel_manager_v1_interface.name)) {
+		toplevels_init(state, registry, name, version);
 	}
 }
 
@@ -36,7 +41,13 @@ static void
 handle_wl_registry_global_remove(void *data, struct wl_registry *registry,
 		uint32_t name)
 {
-	/* nop */
+	struct state *state = data;
+	struct output *output, *tmp;
+	wl_list_for_each_safe(output, tmp, &state->outputs, link) {
+		if (output->global == name) {
+			output_destroy(output);
+		}
+	}
 }
 
 static const struct wl_registry_listener registry_listener = {
@@ -1,20 +1,36 @@
 // SPDX-License-Identifier: GPL-2.0-only
+#define _DEFAULT_SOURCE
 #include <assert.h>
+#include <dirent.h>
+#include <glib.h>
+#include <ini.h>
+#include <pthread.h>
 #include <sfdo-basedir.h>
 #include <sfdo-icon.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sway-client-helpers/log.h>
+#include <sys/stat.h>
 #include "icon.h"
 
 static struct sfdo_icon_ctx *sfdo_icon_ctx;
 static struct sfdo_icon_theme *icon_theme;
+static char *theme_name;
+static bool theme_loaded;
 
 static int icon_size = 22;
 
-void
-icon_init(void)
+/*
+ * Loading a theme scans all its directories, so it is deferred until the
+ * first icon lookup. Menus loaded from the cache never need it.
+ */
+static void
+icon_theme_load(void)
 {
+	theme_loaded = true;
+
 	struct sfdo_basedir_ctx *sfdo_basedir_ctx = sfdo_basedir_ctx_create();
 
 	sfdo_icon_ctx = sfdo_icon_ctx_create(sfdo_basedir_ctx);
@@ -25,16 +41,64 @@ icon_init(void)
 	int options = SFDO_ICON_THEME_LOAD_OPTIONS_DEFAULT;
 	options |= SFDO_ICON_THEME_LOAD_OPTION_RELAXED;
 	options |= SFDO_ICON_THEME_LOAD_OPTION_ALLOW_MISSING;
-	icon_theme = sfdo_icon_theme_load(sfdo_icon_ctx, "Papirus", options);
+	icon_theme = sfdo_icon_theme_load(sfdo_icon_ctx, theme_name, options);
 
 	sfdo_basedir_ctx_destroy(sfdo_basedir_ctx);
 }
 
+static pthread_t theme_thread;
+static bool theme_loading;
+
+static void *
+theme_worker(void *data)
+{
+	icon_theme_load();
+	return NULL;
+}
+
+void
+icon_theme_preload(void)
+{
+	if (!theme_loaded && !theme_loading) {
+		theme_loading = !pthread_create(&theme_thread, NULL,
+			theme_worker, NULL);
+	}
+}
+
+/* Wait for icon_theme_preload(), before anything else looks at the theme */
+static void
+theme_wait(void)
+{
+	if (theme_loading) {
+		pthread_join(theme_thread, NULL);
+		theme_loading = false;
+	}
+}
+
+void
+icon_init(const char *theme)
+{
+	theme_name = strdup(theme);
+}
+
+void
+icon_theme_release(void)
+{
+	theme_wait();
+	if (theme_loaded) {
+		sfdo_icon_theme_destroy(icon_theme);
+		sfdo_icon_ctx_destroy(sfdo_icon_ctx);
+	}
+	icon_theme = NULL;
+	sfdo_icon_ctx = NULL;
+	theme_loaded = false;
+}
+
 void
 icon_finish(void)
 {
-	sfdo_icon_theme_destroy(icon_theme);
-	sfdo_icon_ctx_destroy(sfdo_icon_ctx);
+	icon_theme_release();
+	free(theme_name);
 }
 
 void
@@ -50,6 +114,10 @@ const char *
 icon_strdup_path(const char *icon)
 {
 	assert(icon);
+	theme_wait();
+	if (!theme_loaded) {
+		icon_theme_load();
+	}
 	size_t icon_len = strlen(icon);
 	int scale = 1.0;
 	struct sfdo_icon_file *file = sfdo_icon_theme_lookup(icon_theme, icon,
@@ -73,3 +141,132 @@ icon_strdup_path(const char *icon)
 }
 
 #undef ICON_LOOKUP_OPTIONS
+
+void
+icon_theme_rescan(void)
+{
+	theme_wait();
+	if (theme_loaded && icon_theme && !sfdo_icon_theme_rescan(icon_theme)) {
+		LOG(LOG_ERROR, "cannot rescan icon theme '%s'", theme_name);
+	}
+}
+
+static int
+handle_index_theme(void *user, const char *section, const char *name,
+		const char *value)
+{
+	GPtrArray *themes = user;
+	if (strcmp(section, "Icon Theme") || strcmp(name, "Inherits")) {
+		return 1;
+	}
+	char **inherits = g_strsplit(value, ",", -1);
+	for (char **theme = inherits; *theme; theme++) {
+		g_strstrip(*theme);
+		if (**theme && !g_ptr_array_find_with_equal_func(themes, *theme,
+				g_str_equal, NULL)) {
+			g_ptr_array_add(themes, g_strdup(*theme));
+		}
+	}
+	g_strfreev(inherits);
+	return 1;
+}
+
+void
+icon_for_each_theme_dir(void (*fn)(const char *dir, void *data), void *data)
+{
+	/* Base directories as searched by sfdo-icon */
+	GPtrArray *bases = g_ptr_array_new_with_free_func(g_free);
+	const char *home = getenv("HOME");
+	if (home) {
+		g_ptr_array_add(bases, g_build_filename(home, ".icons", NULL));
+	}
+	struct sfdo_basedir_ctx *ctx = sfdo_basedir_ctx_create();
+	size_t nr_dirs = 0;
+	const struct sfdo_string *dirs = ctx
+		? sfdo_basedir_get_data_dirs(ctx, &nr_dirs) : NULL;
+	for (size_t i = 0; i < nr_dirs; i++) {
+		char *base = g_strndup(dirs[i].data, dirs[i].len);
+		g_ptr_array_add(bases, g_build_filename(base, "icons", NULL));
+		g_free(base);
+	}
+	if (ctx) {
+		sfdo_basedir_ctx_destroy(ctx);
+	}
+
+	/* The theme, the themes it inherits from and the hicolor fallback */
+	GPtrArray *themes = g_ptr_array_new_with_free_func(g_free);
+	g_ptr_array_add(themes, g_strdup(theme_name));
+	for (guint i = 0; i <= themes->len; i++) {
+		if (i == themes->len) {
+			if (g_ptr_array_find_with_equal_func(themes, "hicolor",
+					g_str_equal, NULL)) {
+				break;
+			}
+			g_ptr_array_add(themes, g_strdup("hicolor"));
+		}
+		for (guint j = 0; j < bases->len; j++) {
+			char *dir = g_build_filename(bases->pdata[j],
+				themes->pdata[i], NULL);
+			char *index = g_build_filename(dir, "index.theme", NULL);
+			fn(dir, data);
+			ini_parse(index, handle_index_theme, themes);
+			g_free(index);
+			g_free(dir);
+		}
+	}
+	fn("/usr/share/pixmaps", data);
+
+	g_ptr_array_free(themes, TRUE);
+	g_ptr_array_free(bases, TRUE);
+}
+
+/* Icons are at most this deep in a theme, as in <theme>/<size>/<context> */
+#define THEME_DEPTH (2)
+
+static void
+update_stamp(const char *dir, int depth, int64_t *stamp)
+{
+	struct stat st;
+	if (stat(dir, &st) || !S_ISDIR(st.st_mode)) {
+		return;
+	}
+	int64_t mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+	if (mtime > *stamp) {
+		*stamp = mtime;
+	}
+	if (depth == THEME_DEPTH) {
+		return;
+	}
+
+	/* Only directories are looked at, not the many icons in them */
+	DIR *d = opendir(dir);
+	if (!d) {
+		return;
+	}
+	struct dirent *entry;
+	while ((entry = readdir(d))) {
+		if (entry->d_name[0] == '.' || (entry->d_type != DT_DIR
+				&& entry->d_type != DT_LNK
+				&& entry->d_type != DT_UNKNOWN)) {
+			continue;
+		}
+		char *path = g_build_filename(dir, entry->d_name, NULL);
+		update_stamp(path, depth + 1, stamp);
+		g_free(path);
+	}
+	closedir(d);
+}
+
+static void
+update_theme_stamp(const char *dir, void *data)
+{
+	update_stamp(dir, 0, data);
+}
+
+int64_t
+icon_theme_stamp(void)
+{
+	int64_t stamp = 0;
+	icon_for_each_theme_dir(update_theme_stamp, &stamp);
+	return stamp;
+}
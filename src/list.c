@@ -0,0 +1,122 @@
+// SPDX-License-Identifier: GPL-2.0-only
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sway-client-helpers/log.h>
+#include <sway-client-helpers/loop.h>
+#include <unistd.h>
+#include <wayland-util.h>
+#include "list.h"
+#include "menu.h"
+#include "trappist.h"
+
+/*
+ * Bytes read per wakeup of the event loop, so that a long list is taken in
+ * bit by bit while input and frames keep being handled in between
+ */
+#define LIST_READ_SIZE (64 * 1024)
+
+struct list_reader {
+	struct state *state;
+	struct menu *menu;
+	int fd;
+	struct wl_array line; /* incomplete last line */
+	size_t nr_lines;
+};
+
+/* Lines are "label", "label\ticon" or "label\ticon\tcommand" */
+static void
+add_line(struct menu *menu, char *line)
+{
+	char *fields[3] = { line, NULL, NULL };
+	for (int i = 1; i < 3 && fields[i - 1]; i++) {
+		char *tab = strchr(fields[i - 1], '\t');
+		if (tab) {
+			*tab = '\0';
+			fields[i] = tab + 1;
+		}
+	}
+	if (!*fields[0]) {
+		return;
+	}
+	struct menuitem *item = item_create(menu, fields[0]);
+	if (fields[1] && *fields[1]) {
+		item->icon = menu_strdup(fields[1]);
+	}
+	if (fields[2] && *fields[2]) {
+		item->action = menu_strdup("Execute");
+		item->command = menu_strdup(fields[2]);
+	} else {
+		item->print = true;
+	}
+}
+
+static void
+reader_destroy(struct list_reader *reader)
+{
+	loop_remove_fd(reader->state->eventloop, reader->fd);
+	wl_array_release(&reader->line);
+	free(reader);
+}
+
+static void
+handle_input(int fd, short mask, void *data)
+{
+	struct list_reader *reader = data;
+	char buf[LIST_READ_SIZE];
+	ssize_t len = read(fd, buf, sizeof(buf));
+	if (len < 0 && (errno == EAGAIN || errno == EINTR)) {
+		return;
+	}
+	if (len < 0) {
+		LOG_ERRNO(LOG_ERROR, "cannot read list");
+	}
+
+	char *p = buf, *end = buf + (len > 0 ? len : 0), *newline;
+	while ((newline = memchr(p, '\n', end - p))) {
+		*newline = '\0';
+		if (reader->line.size) {
+			size_t n = newline - p + 1;
+			memcpy(wl_array_add(&reader->line, n), p, n);
+			add_line(reader->menu, reader->line.data);
+			reader->line.size = 0;
+		} else {
+			add_line(reader->menu, p);
+		}
+		reader->nr_lines++;
+		p = newline + 1;
+	}
+	if (p < end) {
+		memcpy(wl_array_add(&reader->line, end - p), p, end - p);
+	}
+	if (len <= 0 && reader->line.size) {
+		/* Last line without a newline */
+		*(char *)wl_array_add(&reader->line, 1) = '\0';
+		add_line(reader->menu, reader->line.data);
+		reader->nr_lines++;
+	}
+	menu_items_added(reader->menu);
+
+	if (len <= 0) {
+		LOG(LOG_DEBUG, "read %zu lines", reader->nr_lines);
+		reader_destroy(reader);
+	}
+}
+
+void
+list_read(struct state *state, struct menu *menu, int fd)
+{
+	struct list_reader *reader = calloc(1, sizeof(*reader));
+	if (!reader) {
+		return;
+	}
+	reader->state = state;
+	reader->menu = menu;
+	reader->fd = fd;
+	wl_array_init(&reader->line);
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	loop_add_fd(state->eventloop, fd, POLLIN, handle_input, reader);
+}
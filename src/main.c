@@ -4,26 +4,82 @@
 #include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sway-client-helpers/log.h>
 #include <sway-client-helpers/loop.h>
+#include <unistd.h>
+#include "catalog.h"
 #include "conf.h"
+#include "daemon.h"
 #include "icon.h"
+#include "list.h"
 #include "menu.h"
 #include "talloc-helpers.h"
+#include "toplevels.h"
 #include "trappist.h"
 
+static bool compile;
+static bool daemon_mode;
+static bool dmenu;
 static bool show_version;
 static int verbose;
 static char *config_file;
 static char *menu_file;
+static char *menu_id;
+static char *output_name;
+static char *command;
+static char *position;
+
+static char *
+set_command(const char *name)
+{
+	command = (char *)name;
+	return NULL;
+}
+
+static char *
+opt_show(void *arg)
+{
+	return set_command("show");
+}
+
+static char *
+opt_hide(void *arg)
+{
+	return set_command("hide");
+}
+
+static char *
+opt_toggle(void *arg)
+{
+	return set_command("toggle");
+}
 
 static struct opt_table opts[] = {
+	OPT_WITH_ARG("--at=<x>,<y>", opt_set_charp, opt_show_charp, &position,
+		"Show the menu at this position instead of at the pointer"),
+	OPT_WITHOUT_ARG("--compile", opt_set_bool, &compile,
+		"Compile menu file into the cache and quit"),
 	OPT_WITH_ARG("-c|--config-file=<filename>", opt_set_charp, opt_show_charp,
 		&config_file, "Specify config file (with path)"),
+	OPT_WITHOUT_ARG("--daemon", opt_set_bool, &daemon_mode,
+		"Keep running with the menu hidden until told to show it"),
+	OPT_WITHOUT_ARG("-d|--dmenu", opt_set_bool, &dmenu,
+		"Read items from stdin instead of a menu file"),
 	OPT_WITHOUT_ARG("-h|--help", opt_usage_and_exit, "[options...]",
 		"Show help message and quit"),
+	OPT_WITHOUT_ARG("--hide", opt_hide, NULL,
+		"Tell the daemon to hide the menu"),
+	OPT_WITH_ARG("--id=<id>", opt_set_charp, opt_show_charp, &menu_id,
+		"Open the menu with this id instead of root-menu"),
 	OPT_WITH_ARG("-m|--menu-file=<filename>", opt_set_charp, opt_show_charp,
 		&menu_file, "Specify menu file (with path)"),
+	OPT_WITHOUT_ARG("--show", opt_show, NULL,
+		"Tell the daemon to show the menu"),
+	OPT_WITHOUT_ARG("--toggle", opt_toggle, NULL,
+		"Tell the daemon to show the menu, or hide it if shown"),
+	OPT_WITH_ARG("--output=<name>", opt_set_charp, opt_show_charp,
+		&output_name, "Show the menu on this output"),
 	OPT_WITHOUT_ARG("-v|--version", opt_set_bool, &show_version,
 		"Show version and quit"),
 	OPT_WITHOUT_ARG("-V|--verbose", opt_inc_intval, &verbose,
@@ -54,9 +110,18 @@ run(void)
 
 	struct conf conf = { 0 };
 	conf_init(&conf, config_file);
+	icon_init(conf.icon.theme);
+
+	/* Menus and fonts are loaded on other threads while connecting */
+	if (!dmenu) {
+		menu_load(tal, &conf, menu_file);
+	}
+	pixmap_warmup();
 
 	struct state state = { 0 };
 	wl_list_init(&state.outputs);
+	state.surface = calloc(1, sizeof(struct surface));
+	state.surface->state = &state;
 
 	state.display = wl_display_connect(NULL);
 	DIE_ON(!state.display, "unable to connect to compositor");
@@ -74,31 +139,33 @@ run(void)
 	state.seat->cursor_surface =
 		wl_compositor_create_surface(state.compositor);
 
-	/*
-	 * TODO: Consider creating one surface per output to avoid cursor
-	 * button on other outputs
-	 */
-	state.surface = calloc(1, sizeof(struct surface));
-	state.surface->state = &state;
-	state.surface->surface = wl_compositor_create_surface(state.compositor);
+	state.eventloop = loop_create();
+	loop_add_fd(state.eventloop, wl_display_get_fd(state.display), POLLIN,
+		display_in, &state);
 
-	struct output *output;
-	wl_list_for_each(output, &state.outputs, link) {
-		/* TODO: Allow selection of output */
-		state.surface->wl_output = output->wl_output;
-		break;
+	/* Windows are announced by the next roundtrip, so the menus go first */
+	if (dmenu) {
+		menu_init_list(tal, &state, &conf);
+		list_read(&state, state.menu, STDIN_FILENO);
+	} else {
+		menu_init(&state, menu_id);
 	}
-	LOG(LOG_INFO, "using output '%s'", output->name);
 
-	surface_layer_surface_create(state.surface);
-
-	icon_init();
+	/* Outputs get their names, and a layer surface each, see output.c */
+	wl_display_roundtrip(state.display);
 
-	menu_init(&state, &conf, menu_file);
+	DIE_ON(!surface_set_output(state.surface, output_name),
+		"cannot find output");
+	LOG(LOG_INFO, "using output '%s'", state.surface->output
+		? state.surface->output->name : "(any)");
 
-	state.eventloop = loop_create();
-	loop_add_fd(state.eventloop, wl_display_get_fd(state.display), POLLIN,
-		display_in, &state);
+	/* A daemon only shows the menu when told to, see daemon.h */
+	state.daemon = daemon_mode;
+	if (!state.daemon) {
+		surface_map(state.surface);
+	}
+	DIE_ON(state.daemon && !daemon_init(&state, &conf),
+		"cannot start daemon");
 
 	state.run_display = true;
 	while (state.run_display) {
@@ -109,15 +176,38 @@ run(void)
 		loop_poll(state.eventloop);
 	}
 
+	daemon_finish(&state);
 	menu_finish(&state);
+	toplevels_finish(&state);
 	surface_destroy(state.surface);
+	state.surface = NULL;
+	struct output *output, *tmp;
+	wl_list_for_each_safe(output, tmp, &state.outputs, link) {
+		output_destroy(output);
+	}
 	if (state.seat->cursor_theme) {
 		wl_cursor_theme_destroy(state.seat->cursor_theme);
 	}
+	pixmap_warmup_finish();
 	icon_finish();
+	catalog_finish();
 	pango_cairo_font_map_set_default(NULL);
 }
 
+static void
+compile_menu(void)
+{
+	TALLOC_CTX *tal defer = xtalloc_new(NULL);
+
+	struct conf conf = { 0 };
+	conf_init(&conf, config_file);
+	icon_init(conf.icon.theme);
+	menu_compile(tal, &conf, menu_file);
+	menu_finish(NULL);
+	icon_finish();
+	catalog_finish();
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -135,7 +225,38 @@ main(int argc, char *argv[])
 	importance = MIN(importance, LOG_DEBUG);
 	log_init(importance);
 
-	DIE_ON(!menu_file, "cannot find menu file");
+	if (command) {
+		int x, y;
+		char at[32] = "";
+		if (position) {
+			DIE_ON(sscanf(position, "%d,%d", &x, &y) != 2
+				|| strcmp(command, "show"),
+				"--at takes <x>,<y> and goes with --show");
+			snprintf(at, sizeof(at), " %d %d", x, y);
+		}
+		DIE_ON(menu_id && (!strcmp(command, "hide")
+			|| strpbrk(menu_id, " \n")),
+			"--id takes an id without spaces and goes with --show "
+			"or --toggle");
+		DIE_ON(output_name && (!strcmp(command, "hide")
+			|| strpbrk(output_name, " \n")),
+			"--output takes a name without spaces and goes with "
+			"--show or --toggle");
+		char buf[256];
+		int len = snprintf(buf, sizeof(buf), "%s%s%s%s%s%s", command,
+			menu_id ? " " : "", menu_id ? menu_id : "", at,
+			output_name ? " @" : "", output_name ? output_name : "");
+		DIE_ON(len >= (int)sizeof(buf), "command is too long");
+		return daemon_send(buf) ? 0 : EXIT_FAILURE;
+	}
+
+	DIE_ON(!menu_file && !dmenu, "cannot find menu file");
+	DIE_ON(daemon_mode && dmenu, "--daemon does not go with --dmenu");
+
+	if (compile) {
+		compile_menu();
+		return 0;
+	}
 
 	if (getenv("TALLOC_REPORT")) {
 		talloc_enable_null_tracking();
@@ -2,325 +2,266 @@
 #define _POSIX_C_SOURCE 200809L
 #include <assert.h>
 #include <cairo.h>
-#include <ctype.h>
 #include <glib.h>
-#include <libxml/parser.h>
-#include <libxml/tree.h>
 #include <pango/pangocairo.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <strings.h>
 #include <sway-client-helpers/log.h>
 #include <sway-client-helpers/loop.h>
 #include <sway-client-helpers/util.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#include "apps.h"
+#include "cache.h"
+#include "catalog.h"
 #include "conf.h"
+#include "daemon.h"
 #include "icon.h"
 #include "menu.h"
+#include "parse.h"
+#include "pipemenu.h"
+#include "toplevels.h"
 #include "trappist.h"
+#include "watch.h"
 
-/* state-machine variables for processing <item></item> */
-static bool in_item;
-static struct menuitem *current_item;
-
-static int menu_level;
-static struct menu *current_menu;
+/*
+ * Menus, items and their strings are allocated from one talloc pool so that
+ * their addresses are stable and they can all be freed in one go.
+ */
+static TALLOC_CTX *arena;
 
 /* vector for <menu id="" label=""> elements */
-static struct menu *menus;
+static struct menu **menus;
 static int nr_menus, alloc_menus;
 
-static char *
-nodename(xmlNode *node, char *buf, int len)
+/*
+ * Interned menu ids, each mapped to the menu it identifies or to NULL if it
+ * has only been referenced so far
+ */
+static GHashTable *ids;
+
+/* Set while pipemenu output is being parsed, see menu_alloc_from() */
+static TALLOC_CTX *transient;
+
+/* The menu file is watched and reloaded when it changes */
+static struct watch *watch;
+static struct conf *menu_conf;
+static const char *menu_filename;
+
+/*
+ * Application and icon theme directories are watched so that installed and
+ * removed packages show up. Setting up the watches walks whole icon themes,
+ * so it waits until the menu has been shown.
+ */
+#define WATCH_DIRS_DELAY (1000)
+static struct watch *apps_watch, *icons_watch;
+static struct loop_timer *watch_dirs_timer;
+
+#define ARENA_POOL_SIZE (256 * 1024)
+
+void
+arena_init(TALLOC_CTX *ctx)
 {
-	if (!node || !node->name) {
-		return NULL;
+	assert(!arena);
+	arena = talloc_pool(ctx, ARENA_POOL_SIZE);
+	if (!arena) {
+		perror("out of memory");
+		exit(EXIT_FAILURE);
 	}
+	ids = g_hash_table_new(g_str_hash, g_str_equal);
+}
 
-	/* Ignore superflous 'text.' in node name */
-	if (node->parent && !strcmp((char *)node->name, "text")) {
-		node = node->parent;
-	}
+void
+menu_alloc_from(TALLOC_CTX *ctx)
+{
+	transient = ctx;
+}
 
-	char *p = buf;
-	p[--len] = 0;
-	for (;;) {
-		const char *name = (char *)node->name;
-		char c;
-		while ((c = *name++) != 0) {
-			*p++ = tolower(c);
-			if (!--len) {
-				return buf;
-			}
-		}
-		*p = 0;
-		node = node->parent;
-		if (!node || !node->name) {
-			return buf;
-		}
-		*p++ = '.';
-		if (!--len) {
-			return buf;
-		}
+static TALLOC_CTX *
+alloc_ctx(void)
+{
+	return transient ? transient : arena;
+}
+
+char *
+menu_strdup(const char *s)
+{
+	return s ? talloc_strdup(alloc_ctx(), s) : NULL;
+}
+
+const char *
+menu_intern_id(const char *id)
+{
+	gpointer key;
+	if (g_hash_table_lookup_extended(ids, id, &key, NULL)) {
+		return key;
 	}
+	char *interned = talloc_strdup(arena, id);
+	g_hash_table_insert(ids, interned, NULL);
+	return interned;
 }
 
-static void
-string_truncate_at_pattern(char *buf, const char *pattern)
+void
+menu_index_id(struct menu *menu)
 {
-	char *p = strstr(buf, pattern);
-	if (!p) {
+	if (!menu->id) {
 		return;
 	}
-	*p = '\0';
+	gpointer key, value;
+	if (g_hash_table_lookup_extended(ids, menu->id, &key, &value)) {
+		/* The first definition of an id wins */
+		if (value) {
+			LOG(LOG_INFO, "duplicate menu id '%s'", menu->id);
+			return;
+		}
+		menu->id = key;
+	}
+	g_hash_table_insert(ids, menu->id, menu);
 }
 
-static struct menu *
-menu_create(const char *id, const char *label)
+struct menu *
+menu_create(const char *id, const char *label, struct menu *parent)
 {
+	if (transient) {
+		struct menu *menu = talloc_zero(transient, struct menu);
+		menu->index = -1;
+		menu->ttl = -1;
+		wl_list_init(&menu->menuitems);
+		menu->id = menu_strdup(id);
+		menu->label = menu_strdup(label);
+		menu->parent = parent;
+		return menu;
+	}
 	if (nr_menus == alloc_menus) {
 		alloc_menus = (alloc_menus + 16) * 2;
-		menus = realloc(menus, alloc_menus * sizeof(struct menu));
+		menus = talloc_realloc(arena, menus, struct menu *, alloc_menus);
 	}
-	struct menu *menu = menus + nr_menus;
-	memset(menu, 0, sizeof(*menu));
-	nr_menus++;
+	struct menu *menu = talloc_zero(arena, struct menu);
+	menus[nr_menus] = menu;
+	menu->index = nr_menus++;
+	menu->ttl = -1;
 	wl_list_init(&menu->menuitems);
-	menu->id = strdup(id);
-	menu->label = strdup(label);
-	menu->parent = current_menu;
+	menu->id = id ? (char *)menu_intern_id(id) : NULL;
+	menu->label = menu_strdup(label);
+	menu->parent = parent;
+	menu_index_id(menu);
 	return menu;
 }
 
-static struct menu *
+int
+menu_count(void)
+{
+	return nr_menus;
+}
+
+struct menu *
+menu_get(int index)
+{
+	return index >= 0 && index < nr_menus ? menus[index] : NULL;
+}
+
+struct menu *
 get_menu_by_id(const char *id)
 {
-	struct menu *menu;
-	for (int i = 0; i < nr_menus; ++i) {
-		menu = menus + i;
-		if (!strcmp(menu->id, id)) {
-			return menu;
-		}
+	/* Windows may be announced before any menu has been loaded */
+	return ids ? g_hash_table_lookup(ids, id) : NULL;
+}
+
+static void
+item_add(struct menu *menu, struct menuitem *menuitem)
+{
+	if (menu->nr_items == menu->alloc_items) {
+		menu->alloc_items = (menu->alloc_items + 16) * 2;
+		menu->items = talloc_realloc(menu, menu->items,
+			struct menuitem *, menu->alloc_items);
+		menu->hot = talloc_realloc(menu, menu->hot,
+			struct menuitem_hot, menu->alloc_items);
 	}
-	return NULL;
+	menuitem->menu = menu;
+	menuitem->index = menu->nr_items;
+	menu->items[menu->nr_items++] = menuitem;
+	menu->items_height += menuitem->box.height;
+	menu->layout.valid = false;
+	wl_list_insert(&menu->menuitems, &menuitem->link);
 }
 
-static struct menuitem *
+struct menuitem *
 item_create(struct menu *menu, const char *label)
 {
-	struct menuitem *menuitem = calloc(1, sizeof(struct menuitem));
+	struct menuitem *menuitem = talloc_zero(alloc_ctx(), struct menuitem);
 	if (!menuitem) {
 		return NULL;
 	}
-	menuitem->label = strdup(label);
+	menuitem->label = menu_strdup(label);
 	menuitem->box.width = MENU_ITEM_WIDTH;
 	menuitem->box.height = MENU_ITEM_HEIGHT;
 	menuitem->selectable = true;
-	wl_list_insert(&menu->menuitems, &menuitem->link);
+	item_add(menu, menuitem);
 	return menuitem;
 }
 
-static struct menuitem *
+struct menuitem *
 separator_create(struct menu *menu, const char *label)
 {
-	struct menuitem *menuitem = calloc(1, sizeof(struct menuitem));
+	struct menuitem *menuitem = talloc_zero(alloc_ctx(), struct menuitem);
 	if (!menuitem) {
 		return NULL;
 	}
 	menuitem->box.width = MENU_ITEM_WIDTH;
 	menuitem->box.height = 5;
 	menuitem->selectable = false;
-	wl_list_insert(&menu->menuitems, &menuitem->link);
+	item_add(menu, menuitem);
 	return menuitem;
 }
 
-/*
- * Handle the following:
- * <item label="" icon="">
- *   <action name="">
- *     <command></command>
- *   </action>
- * </item>
- */
-static void
-fill_item(char *nodename, char *content)
-{
-	string_truncate_at_pattern(nodename, ".item.menu");
-
-	/* <item label=""> defines the start of a new item */
-	if (!strcmp(nodename, "label")) {
-		current_item = item_create(current_menu, content);
-	}
-	if (!current_item) {
-		LOG(LOG_ERROR, "expect <item label=\"\"> element first");
-		return;
-	}
-	if (!strcmp(nodename, "name.action")) {
-		current_item->action = strdup(content);
-	} else if (!strcmp(nodename, "command.action")
-			|| !strcmp(nodename, "execute.action")) {
-		current_item->command = strdup(content);
-	} else if (!strcmp(nodename, "icon")) {
-		current_item->icon = strdup(content);
-	}
-}
-
-static void
-entry(xmlNode *node, char *nodename, char *content)
-{
-	if (!nodename || !content) {
-		return;
-	}
-	string_truncate_at_pattern(nodename, ".openbox_menu");
-	if (in_item) {
-		fill_item(nodename, content);
-	}
-}
-
-static void
-process_node(xmlNode *node)
+void
+item_remove(struct menuitem *item)
 {
-	static char buffer[256];
-
-	char *content = (char *)node->content;
-	if (xmlIsBlankNode(node)) {
-		return;
+	struct menu *menu = item->menu;
+	wl_list_remove(&item->link);
+	for (int i = item->index + 1; i < menu->nr_items; i++) {
+		menu->items[i - 1] = menu->items[i];
+		menu->items[i - 1]->index = i - 1;
+		menu->hot[i - 1] = menu->hot[i];
 	}
-	char *name = nodename(node, buffer, sizeof(buffer));
-	entry(node, name, content);
+	--menu->nr_items;
+	menu->items_height -= item->box.height;
+	menu->layout.valid = false;
 }
 
-static void xml_tree_walk(xmlNode *node);
-
-static void
-traverse(xmlNode *n)
+static bool
+box_equal(const struct box *a, const struct box *b)
 {
-	process_node(n);
-	for (xmlAttr * attr = n->properties; attr; attr = attr->next) {
-		xml_tree_walk(attr->children);
-	}
-	xml_tree_walk(n->children);
-}
-
-/*
- * <menu> elements have three different roles:
- *  * Definition of (sub)menu - has ID, LABEL and CONTENT
- *  * Menuitem of pipemenu type - has EXECUTE and LABEL
- *  * Menuitem of submenu type - has ID only
- */
-static void
-handle_menu_element(xmlNode *n)
-{
-	char *label = (char *)xmlGetProp(n, (const xmlChar *)"label");
-	char *execute = (char *)xmlGetProp(n, (const xmlChar *)"execute");
-	char *id = (char *)xmlGetProp(n, (const xmlChar *)"id");
-	char *icon = (char *)xmlGetProp(n, (const xmlChar *)"icon");
-
-	if (execute) {
-		LOG(LOG_ERROR, "we do not support pipemenus - yet");
-	} else if (label && id) {
-		struct menu **submenu = NULL;
-		if (menu_level > 0) {
-			/*
-			 * In a nested (inline) menu definition we need to
-			 * create an item pointing to the new submenu
-			 */
-			current_item = item_create(current_menu, label);
-			if (icon) {
-				current_item->icon = strdup(icon);
-			}
-			submenu = &current_item->submenu;
-		}
-		++menu_level;
-		current_menu = menu_create(id, label);
-		if (submenu) {
-			*submenu = current_menu;
-		}
-		traverse(n);
-		current_menu = current_menu->parent;
-		--menu_level;
-	} else if (id) {
-		struct menu *menu = get_menu_by_id(id);
-		if (menu) {
-			current_item = item_create(current_menu, menu->label);
-			current_item->submenu = menu;
-		} else {
-			LOG(LOG_ERROR, "no menu with id '%s'", id);
-		}
-	}
-	free(label);
-	free(execute);
-	free(id);
-	free(icon);
+	return a->x == b->x && a->y == b->y && a->width == b->width
+		&& a->height == b->height;
 }
 
-/* This can be one of <separator> and <separator label=""> */
-static void
-handle_separator_element(xmlNode *n)
+void
+flip(bool *value)
 {
-	char *label = (char *)xmlGetProp(n, (const xmlChar *)"label");
-	current_item = separator_create(current_menu, label);
-	if (label) {
-		free(label);
-	}
+	*value = !*value;
 }
 
-static void
-xml_tree_walk(xmlNode *node)
-{
-	for (xmlNode *n = node; n && n->name; n = n->next) {
-		if (!strcasecmp((char *)n->name, "comment")) {
-			continue;
-		}
-		if (!strcasecmp((char *)n->name, "menu")) {
-			handle_menu_element(n);
-			continue;
-		}
-		if (!strcasecmp((char *)n->name, "separator")) {
-			handle_separator_element(n);
-			continue;
-		}
-		if (!strcasecmp((char *)n->name, "item")) {
-			in_item = true;
-			traverse(n);
-			in_item = false;
-			continue;
-		}
-		traverse(n);
-	}
-}
+static void prepare_items(struct menu *menu, void *data);
+static void prepare_visible_items(struct menu *menu);
 
-static void
-parse_xml(const char *filename)
+/* Where @item is shown, which differs from ->box if its menu is scrolled */
+static struct box
+shown_box(struct menuitem *item)
 {
-	assert(filename);
-	xmlDoc *d = xmlReadFile(filename, NULL, 0);
-	if (!d) {
-		LOG(LOG_ERROR, "xmlReadFile()");
-		return;
-	}
-	xml_tree_walk(xmlDocGetRootElement(d));
-	xmlFreeDoc(d);
-	xmlCleanupParser();
+	struct box box = item->box;
+	box.y -= item->menu->scroll;
+	return box;
 }
 
+/* Largest valid menu->scroll */
 static int
-get_menu_height(struct menu *menu)
+max_scroll(struct menu *menu)
 {
-	int height = 0;
-	struct menuitem *menuitem;
-	wl_list_for_each(menuitem, &menu->menuitems, link) {
-		height += menuitem->box.height;
-	}
-	return height;
-}
-
-void
-flip(bool *value)
-{
-	*value = !*value;
+	int view = menu->box.height - 2 * MENU_PADDING_Y;
+	return menu->items_height > view ? menu->items_height - view : 0;
 }
 
 /**
@@ -330,12 +271,35 @@ flip(bool *value)
  * @ref:    Reference box to align to. For a toplevel menu this should just be
  *          a position without size, whereas for a submenu it refers to the
  *          parent menu item box which triggered the submenu.
+ * @right_aligned, @bottom_aligned: Alignment inherited from the parent menu
+ *
+ * Submenus are laid out when they are opened. The result is kept until the
+ * menu is configured with different arguments.
  */
 static void
-configure(struct menu *menu, struct box *screen, struct box *ref)
+configure(struct menu *menu, struct box *screen, struct box *ref,
+		bool right_aligned, bool bottom_aligned)
 {
+	if (menu->layout.valid
+			&& box_equal(&menu->layout.screen, screen)
+			&& box_equal(&menu->layout.ref, ref)
+			&& menu->layout.right_aligned == right_aligned
+			&& menu->layout.bottom_aligned == bottom_aligned) {
+		return;
+	}
+	menu->layout.valid = true;
+	menu->layout.screen = *screen;
+	menu->layout.ref = *ref;
+	menu->layout.right_aligned = right_aligned;
+	menu->layout.bottom_aligned = bottom_aligned;
+	menu->right_aligned = right_aligned;
+	menu->bottom_aligned = bottom_aligned;
+
 	menu->box.width = MENU_ITEM_WIDTH + 2 * MENU_PADDING_X;
-	menu->box.height = get_menu_height(menu) + MENU_PADDING_Y * 2;
+	menu->box.height = menu->items_height + MENU_PADDING_Y * 2;
+	if (menu->box.height > screen->height) {
+		menu->box.height = screen->height;
+	}
 
 	/* TODO: get from config */
 	int menu_overlap_x = -4;
@@ -395,29 +359,47 @@ configure(struct menu *menu, struct box *screen, struct box *ref)
 		}
 	}
 
+	/* Menus taller than the screen are scrolled instead */
+	if (menu->box.y < 0) {
+		menu->box.y = 0;
+	} else if (menu->box.y + menu->box.height > screen->height) {
+		menu->box.y = screen->height - menu->box.height;
+	}
+	if (menu->scroll > max_scroll(menu)) {
+		menu->scroll = max_scroll(menu);
+	}
+
 	int offset = 0;
-	struct menuitem *menuitem;
-	wl_list_for_each_reverse(menuitem, &menu->menuitems, link) {
+	for (int i = 0; i < menu->nr_items; i++) {
+		struct menuitem *menuitem = menu->items[i];
 		menuitem->box.x = menu->box.x + MENU_PADDING_X;
 		menuitem->box.y = menu->box.y + MENU_PADDING_Y + offset;
 		offset += menuitem->box.height;
-		if (menuitem->submenu) {
-			menuitem->submenu->right_aligned = menu->right_aligned;
-			menuitem->submenu->bottom_aligned = menu->bottom_aligned;
-			configure(menuitem->submenu, screen, &menuitem->box);
-		}
+		menu->hot[i] = (struct menuitem_hot){
+			.y = menuitem->box.y,
+			.height = menuitem->box.height,
+			.flags = (menuitem->selectable ? MENUITEM_SELECTABLE : 0)
+				| (menuitem->submenu ? MENUITEM_SUBMENU : 0),
+		};
 	}
+	prepare_visible_items(menu);
 }
 
-static void
-menu_configure(struct menu *menu, int x, int y)
+static bool
+get_screen(struct state *state, struct box *screen)
 {
-	struct state *state = menu->state;
-	struct box screen = {
+	*screen = (struct box){
 		.width = state->surface->width,
 		.height = state->surface->height,
 	};
-	if (!screen.width || !screen.height) {
+	return screen->width && screen->height;
+}
+
+static void
+menu_configure(struct menu *menu, int x, int y)
+{
+	struct box screen;
+	if (!get_screen(menu->state, &screen)) {
 		return;
 	}
 	LOG(LOG_DEBUG, "screen: %dx%d", screen.width, screen.height);
@@ -425,264 +407,1406 @@ menu_configure(struct menu *menu, int x, int y)
 		.x = x,
 		.y = y,
 	};
-	configure(menu, &screen, &ref);
+	configure(menu, &screen, &ref, false, false);
 }
 
+/*
+ * Return the first selectable item of @menu at or beyond @index, stepping by
+ * @step (1 or -1) and wrapping around if @wrap is set
+ */
 static struct menuitem *
-first_selectable_menuitem(struct state *state)
+find_selectable(struct menu *menu, int index, int step, bool wrap)
 {
-	struct menu *menu = state->menu;
-	for (int i = 0; i < nr_menus; ++i) {
-		menu = menus + i;
-		if (!menu->visible) {
-			continue;
+	for (int i = 0; i < menu->nr_items; i++, index += step) {
+		if (index < 0 || index >= menu->nr_items) {
+			if (!wrap) {
+				break;
+			}
+			index = index < 0 ? menu->nr_items - 1 : 0;
+		}
+		if (menu->items[index]->selectable) {
+			return menu->items[index];
 		}
-		struct menuitem *item;
-		return wl_container_of(menu->menuitems.prev, item, link);
 	}
 	return NULL;
 }
 
-static void
-generate_pixmaps(struct menu *menu, struct conf *conf)
+static struct menuitem *
+first_selectable_menuitem(struct state *state)
 {
-	struct menuitem *item;
-	wl_list_for_each(item, &menu->menuitems, link) {
-		pixmap_pair_create(item, conf);
-		if (item->submenu) {
-			generate_pixmaps(item->submenu, conf);
-		}
+	if (!state->open_menus.size) {
+		return NULL;
 	}
+	struct menu **root = state->open_menus.data;
+	return find_selectable(*root, 0, 1, false);
 }
 
 static void
-post_processing(struct menu *menu)
+walk_submenus(struct menu *menu, unsigned int walk,
+		void (*fn)(struct menu *menu, void *data), void *data)
 {
-	/* Resolve icons so that item->icon contains full path to the icon */
-	struct menuitem *item;
-	wl_list_for_each(item, &menu->menuitems, link) {
-		if (item->icon && item->icon[0] != '/') {
-			const char *icon = icon_strdup_path(item->icon);
-			free(item->icon);
-			item->icon = (char *)icon;
+	menu->walk = walk;
+	menu->walking = true;
+	fn(menu, data);
+	struct menuitem *item, *next;
+	wl_list_for_each_safe(item, next, &menu->menuitems, link) {
+		struct menu *submenu = item->submenu;
+		if (!submenu) {
+			continue;
+		}
+		if (submenu->walking) {
+			LOG(LOG_ERROR, "menu '%s' includes itself; dropping it",
+				submenu->id);
+			item_remove(item);
+			continue;
 		}
-		if (item->submenu) {
-			post_processing(item->submenu);
+		if (submenu->walk != walk) {
+			walk_submenus(submenu, walk, fn, data);
 		}
 	}
+	menu->walking = false;
 }
 
-void
-menu_init(struct state *state, struct conf *conf, const char *filename)
-{
-	assert(filename);
-	parse_xml(filename);
-	state->menu = get_menu_by_id("root-menu");
-
-	/* Default menu if no menu.xml found */
-	if (!state->menu) {
-		state->menu = menu_create("root-menu", "");
-	}
-	if (wl_list_empty(&state->menu->menuitems)) {
-		current_item = item_create(state->menu, "foo");
-		current_item->action = strdup("");
-		current_item = item_create(state->menu, "bar");
-		current_item->action = strdup("");
-	}
-
-	struct menu *menu = state->menu;
-	for (int i = 0; i < nr_menus; ++i) {
-		menu = menus + i;
-		menu->state = state;
-	}
+/*
+ * A submenu can be referenced by several items, so the menus reachable from
+ * @root form a graph rather than a tree. Call @fn once for each of them and
+ * drop any reference that would make the graph cyclic.
+ */
+static unsigned int nr_walks;
 
-	state->menu->visible = false;
-	state->selection = first_selectable_menuitem(state);
-	post_processing(state->menu);
-	generate_pixmaps(state->menu, conf);
-	menu_move(state->menu, MENU_X, MENU_Y);
+static void
+walk_menus(struct menu *root, void (*fn)(struct menu *menu, void *data),
+		void *data)
+{
+	walk_submenus(root, ++nr_walks, fn, data);
 }
 
-void
-menu_finish(struct state *state)
+/*
+ * As walk_menus(), for every menu of the file rather than those reachable from
+ * one root, so that any of them can be opened by id without further work
+ */
+static void
+walk_all_menus(void (*fn)(struct menu *menu, void *data), void *data)
 {
-	struct menu *menu = state->menu;
-	for (int i = 0; i < nr_menus; ++i) {
-		menu = menus + i;
-		struct menuitem *item, *next;
-		wl_list_for_each_safe(item, next, &menu->menuitems, link) {
-			free(item->label);
-			free(item->action);
-			free(item->command);
-			free(item->icon);
-			cairo_surface_destroy(item->pixmap.active);
-			cairo_surface_destroy(item->pixmap.inactive);
-			wl_list_remove(&item->link);
-			free(item);
+	unsigned int walk = ++nr_walks;
+	for (int i = 0; i < nr_menus; i++) {
+		if (menus[i]->walk != walk) {
+			walk_submenus(menus[i], walk, fn, data);
 		}
-		free(menu->id);
-		free(menu->label);
 	}
-	if (menus) {
-		free(menus);
-	}
-	alloc_menus = 0;
-	nr_menus = 0;
 }
 
 static void
-close_all_submenus(struct menu *menu)
+generate_pixmaps(struct menu *menu, void *data)
 {
+	struct conf *conf = data;
 	struct menuitem *item;
 	wl_list_for_each(item, &menu->menuitems, link) {
-		if (item->submenu) {
-			item->submenu->visible = false;
-			close_all_submenus(item->submenu);
-		}
+		pixmap_pair_create(item, conf);
 	}
 }
 
-void
-menu_move(struct menu *menu, int x, int y)
+/* Resolve the icon so that item->icon contains full path to the icon */
+static void
+resolve_icon(struct menuitem *item)
 {
-	assert(menu);
-	close_all_submenus(menu);
-	menu_configure(menu, x, y);
-	surface_damage(menu->state->surface);
+	if (item->icon && item->icon[0] != '/') {
+		char *icon = (char *)icon_strdup_path(item->icon);
+		item->icon_name = item->icon;
+		item->icon = talloc_strdup(item, icon);
+		free(icon);
+	}
 }
 
-static struct menu *
-menu_from_item(struct state *state, struct menuitem *menuitem)
+/* Point item->label at its translation, see catalog_translate() */
+static void
+translate_label(struct menuitem *item)
 {
-	struct menu *menu = state->menu;
-	for (int i = 0; i < nr_menus; ++i) {
-		menu = menus + i;
-		struct menuitem *item;
-		wl_list_for_each(item, &menu->menuitems, link) {
-			if (item == menuitem) {
-				return menu;
-			}
-		}
+	const char *label = catalog_translate(item->label);
+	if (!item->label_id && label != item->label) {
+		item->label_id = item->label;
+		item->label = (char *)label;
 	}
-	return NULL;
 }
 
 static void
-open_submenu(struct state *state, struct menuitem *item)
+post_processing(struct menu *menu, void *data)
 {
-	assert(item && item->submenu);
-	struct menu *menu = menu_from_item(state, item);
-	assert(menu);
-	close_all_submenus(menu);
-	item->submenu->visible = true;
+	/* Window titles are not translated */
+	bool translate = !menu->id || strcmp(menu->id, TOPLEVELS_MENU_ID);
+	struct menuitem *item;
+	wl_list_for_each(item, &menu->menuitems, link) {
+		if (translate) {
+			translate_label(item);
+		}
+		resolve_icon(item);
+	}
 }
 
+/* All menus built from one menu file, set aside while the file is reloaded */
+struct generation {
+	TALLOC_CTX *arena;
+	struct menu **menus;
+	int nr_menus, alloc_menus;
+	GHashTable *ids;
+};
+
 static void
-timer_hover_clear(void *data)
+generation_take(struct generation *generation)
 {
-	struct state *state = data;
-	state->hover_timer = NULL;
+	*generation = (struct generation){
+		.arena = arena,
+		.menus = menus,
+		.nr_menus = nr_menus,
+		.alloc_menus = alloc_menus,
+		.ids = ids,
+	};
+	arena = NULL;
+	menus = NULL;
+	nr_menus = 0;
+	alloc_menus = 0;
+	ids = NULL;
+}
 
-	if (!state || !state->selection) {
-		return;
-	}
-	if (state->selection->submenu) {
-		open_submenu(state, state->selection);
-	}
-	surface_damage(state->surface);
+static void
+generation_restore(struct generation *generation)
+{
+	assert(!arena);
+	arena = generation->arena;
+	menus = generation->menus;
+	nr_menus = generation->nr_menus;
+	alloc_menus = generation->alloc_menus;
+	ids = generation->ids;
 }
 
 static void
-timer_hover_start(struct state *state)
+generation_free(struct generation *generation)
 {
-	if (state->hover_timer) {
-		loop_remove_timer(state->eventloop, state->hover_timer);
+	for (int i = 0; i < generation->nr_menus; ++i) {
+		struct menu *menu = generation->menus[i];
+		if (menu->execute) {
+			pipemenu_clear(menu);
+		}
+		for (int j = 0; j < menu->nr_items; j++) {
+			cairo_surface_destroy(menu->items[j]->pixmap.active);
+			cairo_surface_destroy(menu->items[j]->pixmap.inactive);
+		}
 	}
-	state->hover_timer = loop_add_timer(state->eventloop,
-		TRAPPIST_SUBMENU_SHOW_DELAY, timer_hover_clear, state);
+	if (generation->ids) {
+		g_hash_table_destroy(generation->ids);
+	}
+	talloc_free(generation->arena);
 }
 
 static bool
-box_empty(const struct box *box)
+str_equal(const char *a, const char *b)
 {
-	return !box || box->width <= 0 || box->height <= 0;
+	return a == b || (a && b && !strcmp(a, b));
 }
 
+/* Whether the pixmaps of @b can be used for @a */
 static bool
-box_contains_point(const struct box *box, double x, double y)
+item_looks_same(struct menuitem *a, struct menuitem *b)
 {
-	if (box_empty(box)) {
-		return false;
-	}
-	return x >= box->x && x < box->x + box->width
-		&& y >= box->y && y < box->y + box->height;
+	return a->selectable == b->selectable
+		&& !a->submenu == !b->submenu
+		&& a->box.width == b->box.width
+		&& a->box.height == b->box.height
+		&& str_equal(a->label, b->label)
+		&& str_equal(a->icon, b->icon);
 }
 
-static void
-process_initial_position(struct menu *menu, int x, int y)
+static bool
+item_equal(struct menuitem *a, struct menuitem *b)
 {
-	menu_configure(menu, x, y);
-	surface_damage(menu->state->surface);
-	menu->visible = true;
+	return item_looks_same(a, b)
+		&& str_equal(a->command, b->command)
+		&& str_equal(a->action, b->action)
+		&& (!a->submenu || str_equal(a->submenu->id, b->submenu->id));
 }
 
-void
-menu_handle_cursor_motion(struct menu *menu, int x, int y)
+static guint
+item_hash(gconstpointer key)
 {
-	static bool has_run;
-	if (!has_run) {
-		process_initial_position(menu, x, y);
+	const struct menuitem *item = key;
+	guint hash = item->selectable | !!item->submenu << 1;
+	hash = hash * 31 + (item->label ? g_str_hash(item->label) : 0);
+	hash = hash * 31 + (item->icon ? g_str_hash(item->icon) : 0);
+	return hash;
+}
+
+static gboolean
+item_hash_equal(gconstpointer a, gconstpointer b)
+{
+	return item_looks_same((struct menuitem *)a, (struct menuitem *)b);
+}
+
+struct reload {
+	struct generation *old;
+	/* old items by appearance, for items which moved */
+	GHashTable *items;
+};
+
+static void
+steal_pixmaps(struct menuitem *item, struct menuitem *old)
+{
+	item->pixmap = old->pixmap;
+	old->pixmap.active = NULL;
+	old->pixmap.inactive = NULL;
+}
+
+/*
+ * Give each item of @menu the pixmaps of the matching old item, rendering
+ * only those that are new or have changed. If the whole menu is unchanged,
+ * its layout is kept too.
+ */
+static void
+reuse_pixmaps(struct menu *menu, void *data)
+{
+	struct reload *reload = data;
+	struct menu *old = menu->id
+		? g_hash_table_lookup(reload->old->ids, menu->id) : NULL;
+	bool unchanged = old && old->nr_items == menu->nr_items;
+
+	for (int i = 0; i < menu->nr_items; i++) {
+		struct menuitem *item = menu->items[i];
+		if (item->pixmap.active) {
+			/* pipemenu output taken over by adopt_pipemenus() */
+			unchanged = false;
+			continue;
+		}
+		struct menuitem *prev = old && i < old->nr_items
+			? old->items[i] : NULL;
+		if (!prev || !item_equal(item, prev)) {
+			unchanged = false;
+		}
+		if (!prev || !prev->pixmap.active || !item_looks_same(item, prev)) {
+			prev = g_hash_table_lookup(reload->items, item);
+		}
+		if (prev && prev->pixmap.active) {
+			steal_pixmaps(item, prev);
+		} else {
+			pixmap_pair_create(item, menu_conf);
+		}
+	}
+	if (!unchanged || !old->layout.valid) {
+		return;
+	}
+	menu->layout = old->layout;
+	menu->box = old->box;
+	menu->scroll = old->scroll;
+	menu->right_aligned = old->right_aligned;
+	menu->bottom_aligned = old->bottom_aligned;
+	for (int i = 0; i < menu->nr_items; i++) {
+		menu->items[i]->box = old->items[i]->box;
+		menu->hot[i] = old->hot[i];
+	}
+}
+
+/* Find the counterpart of @old in @menu, preferably at the same position */
+static struct menuitem *
+find_item(struct menu *menu, struct menuitem *old)
+{
+	if (old->index < menu->nr_items
+			&& item_looks_same(menu->items[old->index], old)) {
+		return menu->items[old->index];
+	}
+	for (int i = 0; i < menu->nr_items; i++) {
+		if (item_looks_same(menu->items[i], old)) {
+			return menu->items[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Replace the old menus on the open menu stack and the selection with their
+ * counterparts in the new generation, as far as they can be found by id and
+ * appearance.
+ */
+static void
+remap_open_menus(struct state *state)
+{
+	struct menu **open = state->open_menus.data;
+	size_t n = state->open_menus.size / sizeof(*open);
+	struct menuitem *selection = state->selection;
+	struct menu *old_parent = NULL;
+	size_t nr_kept = 0;
+
+	state->selection = NULL;
+	for (size_t i = 0; i < n; i++) {
+		struct menu *old = open[i];
+		struct menu *menu = NULL;
+		struct menuitem *opener = NULL;
+		if (!i) {
+			menu = state->menu;
+		} else if (old->opener && old->opener->menu == old_parent) {
+			opener = find_item(open[i - 1], old->opener);
+			if (opener && str_equal(opener->submenu->id, old->id)) {
+				menu = opener->submenu;
+			}
+		}
+		if (!menu) {
+			break;
+		}
+		if (old->layout.valid) {
+			if (opener) {
+				struct box ref = shown_box(opener);
+				configure(menu, &old->layout.screen, &ref,
+					open[i - 1]->right_aligned,
+					open[i - 1]->bottom_aligned);
+			} else {
+				configure(menu, &old->layout.screen,
+					&old->layout.ref, false, false);
+			}
+		}
+		menu->opener = opener;
+		menu->visible = true;
+		if (menu->execute) {
+			pipemenu_run(state, menu, menu_conf);
+		}
+		if (selection && selection->menu == old) {
+			state->selection = find_item(menu, selection);
+		}
+		open[i] = menu;
+		old_parent = old;
+		++nr_kept;
+	}
+	state->open_menus.size = nr_kept * sizeof(*open);
+}
+
+/* Run the commands of all pipemenus of the menu file in the background */
+static void
+prefetch_pipemenus(void)
+{
+	if (menu_conf->pipemenu.prefetch != PIPEMENU_PREFETCH_STARTUP) {
+		return;
+	}
+	for (int i = 0; i < nr_menus; i++) {
+		if (menus[i]->execute) {
+			pipemenu_enqueue(menus[i], menu_conf);
+		}
+	}
+}
+
+/*
+ * Hand the output of old pipemenus over to new ones with the same command.
+ * Output is kept per command, so the first new pipemenu with it takes it.
+ */
+static void
+adopt_pipemenus(void)
+{
+	for (int i = 0; i < nr_menus; i++) {
+		if (!menus[i]->execute) {
+			continue;
+		}
+		struct menu *old = pipemenu_holder(menus[i]);
+		int index = old->index;
+		if (index >= 0 && index < nr_menus && menus[index] == old) {
+			/* Not old, but taken over by a new one already */
+			continue;
+		}
+		pipemenu_adopt(menus[i], old);
+	}
+}
+
+static void
+reload(void *data)
+{
+	struct state *state = data;
+	struct generation old;
+	generation_take(&old);
+	arena_init(talloc_parent(old.arena));
+
+	/* Labels keep pointing at their translations, see catalog.h */
+	catalog_drop_menu_file();
+
+	/* Keep the menu which is open, if the file still has it */
+	struct menu *root = NULL;
+	if (parse_file(menu_filename)) {
+		root = get_menu_by_id(state->menu->id);
+	}
+	if (!root) {
+		root = get_menu_by_id("root-menu");
+	}
+	if (!root || wl_list_empty(&root->menuitems)) {
+		LOG(LOG_ERROR, "cannot reload '%s'; keeping old menu",
+			menu_filename);
+		struct generation new;
+		generation_take(&new);
+		generation_free(&new);
+		generation_restore(&old);
+		if ((root = get_menu_by_id(TOPLEVELS_MENU_ID))) {
+			toplevels_menu_relink(root);
+		}
+		return;
+	}
+	for (int i = 0; i < nr_menus; ++i) {
+		menus[i]->state = state;
+	}
+	state->menu = root;
+	walk_all_menus(post_processing, NULL);
+	cache_save(menu_filename, menu_conf);
+	struct menu *windows = get_menu_by_id(TOPLEVELS_MENU_ID);
+	if (windows) {
+		toplevels_menu_fill(windows);
+	}
+	adopt_pipemenus();
+
+	struct reload reload = {
+		.old = &old,
+		.items = g_hash_table_new(item_hash, item_hash_equal),
+	};
+	for (int i = 0; i < old.nr_menus; i++) {
+		for (int j = 0; j < old.menus[i]->nr_items; j++) {
+			struct menuitem *item = old.menus[i]->items[j];
+			if (!g_hash_table_contains(reload.items, item)) {
+				g_hash_table_insert(reload.items, item, item);
+			}
+		}
+	}
+	walk_all_menus(reuse_pixmaps, &reload);
+	g_hash_table_destroy(reload.items);
+
+	remap_open_menus(state);
+	generation_free(&old);
+	prefetch_pipemenus();
+
+	/* Nothing points into the old cache file anymore */
+	cache_finish();
+	surface_damage(state->surface);
+	LOG(LOG_INFO, "reloaded '%s'", menu_filename);
+}
+
+static void
+apps_changed(const char **paths, size_t nr_paths, void *data)
+{
+	struct menu *menu = get_menu_by_id(APPS_MENU_ID);
+	if (menu) {
+		apps_menu_update(menu, paths, nr_paths);
+		cache_save(menu_filename, menu_conf);
+	}
+}
+
+/*
+ * Resolve the icons named in @names (all if NULL) again, and render the items
+ * whose icon file has changed
+ */
+static bool
+refresh_icons(struct menu *menu, GHashTable *names)
+{
+	bool changed = false;
+	for (int i = 0; i < menu->nr_items; i++) {
+		struct menuitem *item = menu->items[i];
+		if (item->submenu && item->submenu->index < 0) {
+			changed |= refresh_icons(item->submenu, names);
+		}
+		if (!item->icon_name || (names
+				&& !g_hash_table_contains(names, item->icon_name))) {
+			continue;
+		}
+		char *icon = (char *)icon_strdup_path(item->icon_name);
+		if (!str_equal(icon, item->icon)) {
+			item->icon = talloc_strdup(item, icon);
+			cairo_surface_destroy(item->pixmap.active);
+			cairo_surface_destroy(item->pixmap.inactive);
+			pixmap_pair_create(item, menu_conf);
+			changed = true;
+		}
+		free(icon);
+	}
+	return changed;
+}
+
+static void
+icons_changed(const char **paths, size_t nr_paths, void *data)
+{
+	struct state *state = data;
+	GHashTable *names = NULL;
+	if (paths) {
+		/* Icon files are named after their icon */
+		names = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+			NULL);
+		for (size_t i = 0; i < nr_paths; i++) {
+			char *name = g_path_get_basename(paths[i]);
+			char *dot = strrchr(name, '.');
+			if (dot) {
+				*dot = '\0';
+			}
+			g_hash_table_add(names, name);
+		}
+	}
+	icon_theme_rescan();
+	bool changed = false;
+	for (int i = 0; i < nr_menus; i++) {
+		changed |= refresh_icons(menus[i], names);
+	}
+	if (names) {
+		g_hash_table_destroy(names);
+	}
+	if (changed) {
+		cache_save(menu_filename, menu_conf);
+		surface_damage(state->surface);
+	}
+}
+
+static void
+add_watch_dir(const char *dir, void *data)
+{
+	watch_add_dir(data, dir);
+}
+
+static void
+watch_dirs_start(void *data)
+{
+	struct state *state = data;
+	watch_dirs_timer = NULL;
+	apps_watch = watch_dirs(state->eventloop, apps_changed, state);
+	if (apps_watch) {
+		apps_for_each_dir(add_watch_dir, apps_watch);
+	}
+	icons_watch = watch_dirs(state->eventloop, icons_changed, state);
+	if (icons_watch) {
+		icon_for_each_theme_dir(add_watch_dir, icons_watch);
+	}
+}
+
+/* What menu_load() has done, on its own thread unless that cannot be started */
+static struct {
+	pthread_t thread;
+	bool threaded;
+	bool cached;
+} load;
+
+/* Runs on the loader thread, so must not touch the state */
+static void *
+load_worker(void *data)
+{
+	load.cached = cache_load(menu_filename, menu_conf);
+	if (!load.cached) {
+		/* Icons are resolved once parsed, so have the theme by then */
+		icon_theme_preload();
+		parse_file(menu_filename);
+	}
+	return NULL;
+}
+
+void
+menu_load(TALLOC_CTX *ctx, struct conf *conf, const char *filename)
+{
+	assert(filename);
+	arena_init(ctx);
+	menu_conf = conf;
+	menu_filename = filename;
+	load.threaded = !pthread_create(&load.thread, NULL, load_worker, NULL);
+	if (!load.threaded) {
+		load_worker(NULL);
+	}
+}
+
+void
+menu_init(struct state *state, const char *id)
+{
+	const char *filename = menu_filename;
+	struct conf *conf = menu_conf;
+	if (load.threaded) {
+		pthread_join(load.thread, NULL);
+		load.threaded = false;
+	}
+	bool cached = load.cached;
+	if (id) {
+		state->menu = get_menu_by_id(id);
+		if (!state->menu) {
+			LOG(LOG_ERROR, "no menu '%s' in '%s'", id, filename);
+		}
+	}
+	if (!state->menu) {
+		state->menu = get_menu_by_id("root-menu");
+	}
+
+	/* Default to the application menu if no menu.xml found */
+	if (!state->menu) {
+		state->menu = get_menu_by_id(APPS_MENU_ID);
+	}
+	if (!state->menu) {
+		state->menu = apps_menu_create(APPS_MENU_ID);
+	}
+	if (wl_list_empty(&state->menu->menuitems)) {
+		struct menuitem *item = item_create(state->menu, "foo");
+		item->action = menu_strdup("");
+		item = item_create(state->menu, "bar");
+		item->action = menu_strdup("");
+	}
+
+	struct menu *menu = state->menu;
+	for (int i = 0; i < nr_menus; ++i) {
+		menu = menus[i];
+		menu->state = state;
+	}
+
+	wl_array_init(&state->open_menus);
+	state->menu->visible = false;
+	state->selection = first_selectable_menuitem(state);
+	if (!cached) {
+		walk_all_menus(post_processing, NULL);
+		cache_save(filename, conf);
+	}
+	if ((menu = get_menu_by_id(TOPLEVELS_MENU_ID))) {
+		/* The window list is neither cached nor parsed */
+		toplevels_menu_fill(menu);
+	}
+	walk_all_menus(generate_pixmaps, conf);
+	menu_move(state->menu, MENU_X, MENU_Y);
+	if (state->eventloop) {
+		watch = watch_file(state->eventloop, filename, reload, state);
+		watch_dirs_timer = loop_add_timer(state->eventloop,
+			WATCH_DIRS_DELAY, watch_dirs_start, state);
+		prefetch_pipemenus();
+	}
+}
+
+void
+menu_init_list(TALLOC_CTX *ctx, struct state *state, struct conf *conf)
+{
+	arena_init(ctx);
+	menu_conf = conf;
+	state->menu = menu_create(NULL, NULL, NULL);
+	state->menu->state = state;
+	state->menu->lazy = true;
+	wl_array_init(&state->open_menus);
+	menu_move(state->menu, MENU_X, MENU_Y);
+}
+
+void
+menu_compile(TALLOC_CTX *ctx, struct conf *conf, const char *filename)
+{
+	assert(filename);
+	arena_init(ctx);
+	parse_file(filename);
+	struct menu *root = get_menu_by_id("root-menu");
+	if (!root) {
+		LOG(LOG_ERROR, "no root-menu in '%s'", filename);
+		return;
+	}
+	walk_all_menus(post_processing, NULL);
+	cache_save(filename, conf);
+}
+
+void
+menu_finish(struct state *state)
+{
+	if (state) {
+		wl_array_release(&state->open_menus);
+	}
+	watch_destroy(watch);
+	watch = NULL;
+	if (watch_dirs_timer) {
+		loop_remove_timer(state->eventloop, watch_dirs_timer);
+		watch_dirs_timer = NULL;
+	}
+	watch_destroy(apps_watch);
+	watch_destroy(icons_watch);
+	apps_watch = NULL;
+	icons_watch = NULL;
+	struct generation generation;
+	generation_take(&generation);
+	generation_free(&generation);
+	cache_finish();
+}
+
+static void
+open_menu(struct state *state, struct menu *menu)
+{
+	struct menu **top = wl_array_add(&state->open_menus, sizeof(*top));
+	if (!top) {
+		return;
+	}
+	*top = menu;
+	menu->visible = true;
+
+	/* Render items which changed while the menu was hidden */
+	prepare_items(menu, state);
+}
+
+/* Close the open menus above @keep, or all of them if @keep is NULL */
+static void
+close_menus_above(struct state *state, struct menu *keep)
+{
+	struct menu **open = state->open_menus.data;
+	size_t n = state->open_menus.size / sizeof(*open);
+	size_t nr_kept = n;
+	if (keep) {
+		while (nr_kept && open[nr_kept - 1] != keep) {
+			--nr_kept;
+		}
+		if (!nr_kept) {
+			return;
+		}
+	} else {
+		nr_kept = 0;
+	}
+	for (size_t i = nr_kept; i < n; i++) {
+		open[i]->visible = false;
+		if (open[i]->execute) {
+			pipemenu_cancel(open[i]);
+		}
+	}
+	state->open_menus.size = nr_kept * sizeof(*open);
+}
+
+static void
+close_all_submenus(struct menu *menu)
+{
+	close_menus_above(menu->state, menu);
+}
+
+void
+menu_move(struct menu *menu, int x, int y)
+{
+	assert(menu);
+	close_all_submenus(menu);
+	menu_configure(menu, x, y);
+	surface_damage(menu->state->surface);
+}
+
+static void
+open_submenu(struct state *state, struct menuitem *item)
+{
+	assert(item && item->submenu);
+	if (!item->menu->visible) {
+		return;
+	}
+	struct menu *submenu = item->submenu;
+	if (submenu->visible && submenu->opener == item) {
+		close_all_submenus(submenu);
+		return;
+	}
+	close_all_submenus(item->menu);
+	if (submenu->execute) {
+		pipemenu_run(state, submenu, menu_conf);
+	}
+	struct box screen;
+	if (get_screen(state, &screen)) {
+		struct box ref = shown_box(item);
+		configure(item->submenu, &screen, &ref,
+			item->menu->right_aligned, item->menu->bottom_aligned);
+	}
+	open_menu(state, item->submenu);
+	item->submenu->opener = item;
+}
+
+void
+menu_remove_items(struct menu *menu)
+{
+	struct state *state = menu->state;
+	for (int i = 0; i < menu->nr_items; i++) {
+		struct menuitem *item = menu->items[i];
+		if (state && state->selection == item) {
+			state->selection = NULL;
+		}
+		cairo_surface_destroy(item->pixmap.active);
+		cairo_surface_destroy(item->pixmap.inactive);
+		item->pixmap.active = NULL;
+		item->pixmap.inactive = NULL;
+		struct menu *submenu = item->submenu;
+		if (!submenu || submenu->index >= 0) {
+			continue;
+		}
+		/* Submenus defined by the output of a pipemenu go with it */
+		if (submenu->execute) {
+			pipemenu_clear(submenu);
+		} else {
+			menu_remove_items(submenu);
+		}
+	}
+	menu->nr_items = 0;
+	menu->items_height = 0;
+	menu->layout.valid = false;
+	wl_list_init(&menu->menuitems);
+}
+
+static void
+prepare_items(struct menu *menu, void *data)
+{
+	menu->state = data;
+	if (menu->lazy) {
+		/* see prepare_visible_items() */
+		return;
+	}
+	struct menuitem *item;
+	wl_list_for_each(item, &menu->menuitems, link) {
+		if (!item->pixmap.active) {
+			resolve_icon(item);
+			pixmap_pair_create(item, menu_conf);
+		}
+	}
+}
+
+/*
+ * Damage @box, widened by the border which draw_rect() strokes along the edges
+ * of a menu
+ */
+static void
+damage_box(struct state *state, const struct box *box)
+{
+	surface_damage_rect(state->surface, box->x - 1, box->y - 1,
+		box->width + 2, box->height + 2);
+}
+
+/* Lay out open menus which have changed, damaging where they were and are */
+static void
+relayout_open_menus(struct state *state)
+{
+	struct box screen;
+	if (!get_screen(state, &screen)) {
+		return;
+	}
+	struct menu **open = state->open_menus.data;
+	size_t n = state->open_menus.size / sizeof(*open);
+	for (size_t i = 0; i < n; i++) {
+		if (open[i]->layout.valid) {
+			continue;
+		}
+		struct box old = open[i]->box;
+		struct menuitem *opener = open[i]->opener;
+		if (i && opener) {
+			struct box ref = shown_box(opener);
+			configure(open[i], &screen, &ref,
+				opener->menu->right_aligned,
+				opener->menu->bottom_aligned);
+		} else {
+			configure(open[i], &screen, &open[i]->layout.ref,
+				false, false);
+		}
+		damage_box(state, &old);
+		damage_box(state, &open[i]->box);
+	}
+}
+
+void
+menu_items_added(struct menu *menu)
+{
+	struct state *state = menu->state;
+	walk_menus(menu, prepare_items, state);
+	if (!menu->visible) {
+		return;
+	}
+
+	/* Open menus grow in place, so lay out any that have changed */
+	relayout_open_menus(state);
+}
+
+void
+menu_items_appended(struct menu *menu, int first)
+{
+	if (!menu->lazy) {
+		for (int i = first; i < menu->nr_items; i++) {
+			struct menuitem *item = menu->items[i];
+			if (!item->pixmap.active) {
+				resolve_icon(item);
+				pixmap_pair_create(item, menu_conf);
+			}
+		}
+	}
+	if (menu->visible) {
+		relayout_open_menus(menu->state);
+	}
+}
+
+void
+menu_item_changed(struct menuitem *item)
+{
+	struct menu *menu = item->menu;
+	cairo_surface_destroy(item->pixmap.active);
+	cairo_surface_destroy(item->pixmap.inactive);
+	item->pixmap.active = NULL;
+	item->pixmap.inactive = NULL;
+
+	/* Hidden menus are rendered once opened, see open_menu() */
+	if (!menu->visible) {
+		return;
+	}
+	if (menu->lazy && (item->index < menu->rendered.first
+			|| item->index >= menu->rendered.last)) {
+		return;
+	}
+	resolve_icon(item);
+	pixmap_pair_create(item, menu_conf);
+
+	/* Items of a scrolled menu are clipped to it, see draw_menu() */
+	struct box box = shown_box(item);
+	int top = MAX(box.y, menu->box.y + MENU_PADDING_Y);
+	int bottom = MIN(box.y + box.height,
+		menu->box.y + menu->box.height - MENU_PADDING_Y);
+	surface_damage_rect(menu->state->surface, box.x, top, box.width,
+		bottom - top);
+}
+
+void
+menu_item_destroy(struct menuitem *item)
+{
+	struct menu *menu = item->menu;
+	struct state *state = menu->state;
+	if (state && state->selection == item) {
+		state->selection = NULL;
+	}
+	item_remove(item);
+	cairo_surface_destroy(item->pixmap.active);
+	cairo_surface_destroy(item->pixmap.inactive);
+	talloc_free(item);
+	if (menu->visible) {
+		relayout_open_menus(state);
+	}
+}
+
+/* Index of the first item of @menu which extends below @y */
+static int
+first_item_below(struct menu *menu, int y)
+{
+	int lo = 0, hi = menu->nr_items;
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		if (menu->hot[mid].y + menu->hot[mid].height <= y) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/*
+ * Render the items of a lazy menu which are in view or within a screenful of
+ * it, and drop the pixmaps of those which have gone further out of view
+ */
+static void
+prepare_visible_items(struct menu *menu)
+{
+	if (!menu->lazy) {
+		return;
+	}
+	int top = menu->box.y + menu->scroll;
+	int first = first_item_below(menu, top - menu->box.height);
+	int last = first_item_below(menu, top + 2 * menu->box.height) + 1;
+	last = MIN(last, menu->nr_items);
+	for (int i = menu->rendered.first; i < menu->rendered.last; i++) {
+		if (i < menu->nr_items && (i < first || i >= last)) {
+			struct menuitem *item = menu->items[i];
+			cairo_surface_destroy(item->pixmap.active);
+			cairo_surface_destroy(item->pixmap.inactive);
+			item->pixmap.active = NULL;
+			item->pixmap.inactive = NULL;
+		}
+	}
+	for (int i = first; i < last; i++) {
+		struct menuitem *item = menu->items[i];
+		if (!item->pixmap.active) {
+			resolve_icon(item);
+			pixmap_pair_create(item, menu_conf);
+		}
 	}
-	has_run = true;
+	menu->rendered.first = first;
+	menu->rendered.last = last;
+}
 
-	if (!menu->visible) {
+static void
+scroll_menu(struct menu *menu, int scroll)
+{
+	scroll = MAX(0, MIN(scroll, max_scroll(menu)));
+	if (scroll == menu->scroll) {
 		return;
 	}
-	struct menuitem *item;
-	wl_list_for_each(item, &menu->menuitems, link) {
-		if (!box_contains_point(&item->box, x, y)) {
-			/* Iterate over open submenus */
-			if (item->submenu && item->submenu->visible) {
-				menu_handle_cursor_motion(item->submenu, x, y);
-			}
+	menu->scroll = scroll;
+	prepare_visible_items(menu);
+	surface_damage(menu->state->surface);
+}
+
+/* Scroll the menu of @item just far enough to bring it into view */
+static void
+scroll_to_item(struct menuitem *item)
+{
+	struct menu *menu = item->menu;
+	int top = menu->box.y + MENU_PADDING_Y + menu->scroll;
+	int bottom = top + menu->box.height - 2 * MENU_PADDING_Y;
+	if (item->box.y < top) {
+		scroll_menu(menu, menu->scroll - (top - item->box.y));
+	} else if (item->box.y + item->box.height > bottom) {
+		scroll_menu(menu, menu->scroll
+			+ item->box.y + item->box.height - bottom);
+	}
+}
+
+/* Whether @a and @b hold the same items, down to any unregistered submenus */
+static bool
+items_equal(struct menu *a, struct menu *b)
+{
+	if (a->nr_items != b->nr_items) {
+		return false;
+	}
+	for (int i = 0; i < a->nr_items; i++) {
+		struct menuitem *item = a->items[i], *other = b->items[i];
+		if (!item_equal(item, other)) {
+			return false;
+		}
+		if (!item->submenu || item->submenu->index >= 0) {
 			continue;
 		}
-		if (!item->selectable) {
+		if (!str_equal(item->submenu->execute, other->submenu->execute)
+				|| !items_equal(item->submenu, other->submenu)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Give items of @menu without pixmaps those of matching items of @old */
+static void
+take_pixmaps(struct menu *menu, struct menu *old)
+{
+	GHashTable *items = g_hash_table_new(item_hash, item_hash_equal);
+	for (int i = 0; i < old->nr_items; i++) {
+		if (!g_hash_table_contains(items, old->items[i])) {
+			g_hash_table_insert(items, old->items[i], old->items[i]);
+		}
+	}
+	for (int i = 0; i < menu->nr_items; i++) {
+		struct menuitem *item = menu->items[i];
+		struct menuitem *prev = g_hash_table_lookup(items, item);
+		if (!prev) {
 			continue;
 		}
-		if (!item->submenu) {
-			/* Cursor is over an ordinary (not submenu) item */
-			close_all_submenus(menu);
-			menu->state->selection = item;
-			break;
-		} else if (!item->submenu->visible) {
-			/*
-			 * Cursor is over a new (not visible yet) submenu,
-			 * so let's just set the selection and wait for the
-			 * hover-timer to timeout
-			 */
-			menu->state->selection = item;
+		g_hash_table_remove(items, prev);
+		if (!item->pixmap.active && prev->pixmap.active) {
+			steal_pixmaps(item, prev);
+		}
+		if (item->submenu && item->submenu->index < 0
+				&& prev->submenu->index < 0) {
+			take_pixmaps(item->submenu, prev->submenu);
+		}
+	}
+	g_hash_table_destroy(items);
+}
+
+bool
+menu_replace_items(struct menu *menu, struct menu *from)
+{
+	/* Icons of @menu are resolved, so compare like with like */
+	walk_menus(from, post_processing, NULL);
+	if (items_equal(menu, from)) {
+		return false;
+	}
+	struct state *state = menu->state;
+	struct menuitem *selection = state ? state->selection : NULL;
+	if (selection && selection->menu != menu) {
+		selection = NULL;
+	}
+	if (menu->visible) {
+		close_all_submenus(menu);
+	}
+	take_pixmaps(from, menu);
+	menu_remove_items(menu);
+	for (int i = 0; i < from->nr_items; i++) {
+		struct menuitem *item = from->items[i];
+		if (item->submenu && item->submenu->parent == from) {
+			item->submenu->parent = menu;
+		}
+		item_add(menu, item);
+	}
+	from->nr_items = 0;
+	from->items_height = 0;
+	wl_list_init(&from->menuitems);
+	if (selection) {
+		state->selection = find_item(menu, selection);
+	}
+	return true;
+}
+
+static void
+timer_hover_clear(void *data)
+{
+	struct state *state = data;
+	state->hover_timer = NULL;
+
+	if (!state || !state->selection) {
+		return;
+	}
+	if (state->selection->submenu) {
+		open_submenu(state, state->selection);
+	}
+	surface_damage(state->surface);
+}
+
+static void
+timer_hover_start(struct state *state)
+{
+	if (state->hover_timer) {
+		loop_remove_timer(state->eventloop, state->hover_timer);
+	}
+	state->hover_timer = loop_add_timer(state->eventloop,
+		TRAPPIST_SUBMENU_SHOW_DELAY, timer_hover_clear, state);
+}
+
+static bool
+box_empty(const struct box *box)
+{
+	return !box || box->width <= 0 || box->height <= 0;
+}
+
+static bool
+box_contains_point(const struct box *box, double x, double y)
+{
+	if (box_empty(box)) {
+		return false;
+	}
+	return x >= box->x && x < box->x + box->width
+		&& y >= box->y && y < box->y + box->height;
+}
+
+/*
+ * Where the root menu is to be opened once it is shown: at @x, @y as soon as
+ * the surface is configured, or else wherever the pointer first moves
+ */
+static struct {
+	bool pending;
+	bool at_pointer;
+	int x;
+	int y;
+} placement = {
+	.pending = true,
+	.at_pointer = true,
+};
+
+static void
+process_initial_position(struct menu *menu, int x, int y)
+{
+	menu_configure(menu, x, y);
+	surface_damage(menu->state->surface);
+	close_menus_above(menu->state, NULL);
+	open_menu(menu->state, menu);
+}
+
+/* Binary search for the index of the item under the point, or -1 */
+static int
+item_at(struct menu *menu, int x, int y)
+{
+	if (x < menu->box.x + MENU_PADDING_X
+			|| x >= menu->box.x + MENU_PADDING_X + MENU_ITEM_WIDTH
+			|| y < menu->box.y + MENU_PADDING_Y
+			|| y >= menu->box.y + menu->box.height - MENU_PADDING_Y) {
+		return -1;
+	}
+	y += menu->scroll;
+	int lo = 0, hi = menu->nr_items - 1;
+	while (lo <= hi) {
+		int mid = lo + (hi - lo) / 2;
+		const struct menuitem_hot *hot = &menu->hot[mid];
+		if (y < hot->y) {
+			hi = mid - 1;
+		} else if (y >= hot->y + hot->height) {
+			lo = mid + 1;
+		} else {
+			return mid;
+		}
+	}
+	return -1;
+}
+
+static bool
+is_closed_pipemenu(struct menuitem *item)
+{
+	return item && item->submenu && item->submenu->execute
+		&& !item->submenu->visible;
+}
+
+/* Stop the command of the selected pipemenu unless @item is still selected */
+static void
+cancel_prefetch(struct state *state, struct menuitem *item)
+{
+	struct menuitem *prev = state->selection;
+	if (prev != item && is_closed_pipemenu(prev)) {
+		pipemenu_cancel_prefetch(prev->submenu);
+	}
+}
+
+/*
+ * The hover timer gives some notice before a submenu is opened, so start the
+ * command of a pipemenu as soon as the pointer gets to its item, and stop it
+ * again once the pointer is anywhere else before the submenu is opened. @item
+ * is the item under the pointer, or NULL if there is none.
+ */
+static void
+prefetch(struct state *state, struct menuitem *item)
+{
+	cancel_prefetch(state, item);
+	if (is_closed_pipemenu(item)) {
+		pipemenu_prefetch(state, item->submenu, menu_conf);
+	}
+}
+
+static void
+cursor_motion(struct state *state, int x, int y)
+{
+	/* Submenus are drawn on top of their parents, so start at the top */
+	struct menu **open = state->open_menus.data;
+	int index = -1;
+	struct menu *menu = NULL;
+	for (int i = state->open_menus.size / sizeof(*open) - 1; i >= 0; i--) {
+		menu = open[i];
+		index = item_at(menu, x, y);
+		if (index >= 0) {
 			break;
 		}
 	}
+	if (index < 0 || !(menu->hot[index].flags & MENUITEM_SELECTABLE)) {
+		prefetch(state, NULL);
+		return;
+	}
+	struct menuitem *item = menu->items[index];
+	prefetch(state, item);
+	if (!(menu->hot[index].flags & MENUITEM_SUBMENU)) {
+		/* Cursor is over an ordinary (not submenu) item */
+		close_all_submenus(menu);
+		state->selection = item;
+	} else if (!item->submenu->visible) {
+		/*
+		 * Cursor is over a new (not visible yet) submenu, so let's
+		 * just set the selection and wait for the hover-timer to
+		 * timeout
+		 */
+		state->selection = item;
+	}
+}
+
+void
+menu_handle_cursor_motion(struct menu *menu, int x, int y)
+{
+	if (placement.pending && placement.at_pointer) {
+		placement.pending = false;
+		process_initial_position(menu, x, y);
+	}
+
+	if (!menu->visible) {
+		return;
+	}
+	cursor_motion(menu->state, x, y);
 	timer_hover_start(menu->state);
 	surface_damage(menu->state->surface);
 }
 
 void
-menu_handle_button_pressed(struct state *state, int x, int y)
+menu_handle_pointer_leave(struct state *state)
 {
-	struct menu *menu;
-	for (int i = 0; i < nr_menus; ++i) {
-		menu = menus + i;
-		if (!menu->visible) {
-			continue;
+	prefetch(state, NULL);
+}
+
+void
+menu_handle_configure(struct state *state)
+{
+	if (placement.pending && !placement.at_pointer) {
+		placement.pending = false;
+		process_initial_position(state->menu, placement.x, placement.y);
+	}
+}
+
+/* Make the menu called @id the one which menu_show() opens */
+static bool
+set_root(struct state *state, const char *id)
+{
+	struct menu *menu = get_menu_by_id(id);
+	if (!menu) {
+		LOG(LOG_ERROR, "no menu '%s'", id);
+		return false;
+	}
+	if (menu != state->menu) {
+		close_menus_above(state, NULL);
+		state->selection = NULL;
+		search_clear();
+		state->menu = menu;
+	}
+	return true;
+}
+
+void
+menu_show(struct state *state, const char *id, const char *output, int x,
+		int y)
+{
+	if ((id && !set_root(state, id))
+			|| !surface_set_output(state->surface, output)) {
+		return;
+	}
+	pipemenu_resume(menu_conf);
+	placement.pending = true;
+	placement.at_pointer = x < 0 || y < 0;
+	placement.x = x;
+	placement.y = y;
+	if (!surface_is_configured(state->surface)) {
+		surface_map(state->surface);
+		return;
+	}
+
+	/* Already shown, so the pointer position is known */
+	if (placement.at_pointer) {
+		placement.x = state->seat->pointer_x;
+		placement.y = state->seat->pointer_y;
+		placement.at_pointer = false;
+	}
+	menu_handle_configure(state);
+}
+
+void
+menu_hide(struct state *state)
+{
+	if (!state->daemon) {
+		state->run_display = false;
+		return;
+	}
+	if (state->hover_timer) {
+		loop_remove_timer(state->eventloop, state->hover_timer);
+		state->hover_timer = NULL;
+	}
+	close_menus_above(state, NULL);
+	pipemenu_park();
+	state->selection = first_selectable_menuitem(state);
+	search_clear();
+	surface_unmap(state->surface);
+	daemon_trim(state);
+}
+
+void
+menu_drop_caches(struct state *state)
+{
+	for (int i = 0; i < nr_menus; i++) {
+		if (menus[i]->execute && menus[i]->content) {
+			pipemenu_clear(menus[i]);
+		}
+	}
+}
+
+void
+menu_handle_scroll(struct state *state, int x, int y, int dy)
+{
+	/* Submenus are drawn on top of their parents, so start at the top */
+	struct menu **open = state->open_menus.data;
+	for (int i = state->open_menus.size / sizeof(*open) - 1; i >= 0; i--) {
+		if (box_contains_point(&open[i]->box, x, y)) {
+			close_all_submenus(open[i]);
+			scroll_menu(open[i], open[i]->scroll + dy);
+			cursor_motion(state, x, y);
+			return;
 		}
-		if (box_contains_point(&menu->box, (double)x, (double)y)) {
+	}
+}
+
+void
+menu_handle_button_pressed(struct state *state, int x, int y)
+{
+	struct menu **menu;
+	wl_array_for_each(menu, &state->open_menus) {
+		if (box_contains_point(&(*menu)->box, (double)x, (double)y)) {
 			return;
 		}
 	}
-	state->run_display = false;
+	menu_hide(state);
 }
 
 static void
@@ -733,63 +1857,121 @@ out:
 	g_strfreev(argv);
 }
 
+/*
+ * Run the command of @item, or print its label for list items read from stdin
+ * without a command. Items of the window list activate their window.
+ */
+static void
+activate(struct state *state, struct menuitem *item)
+{
+	if (item->print) {
+		printf("%s\n", item->label);
+		fflush(stdout);
+	} else if (item->toplevel) {
+		toplevels_activate(state, item);
+	} else {
+		spawn_async_no_shell(item->command);
+	}
+	menu_hide(state);
+}
+
 void
 menu_handle_button_released(struct state *state, int x, int y)
 {
 	if (!state || !state->selection) {
 		return;
 	}
-	spawn_async_no_shell(state->selection->command);
-	state->run_display = false;
+	activate(state, state->selection);
 }
 
-enum trappist_direction {
-	DIRECTION_UP,
-	DIRECTION_DOWN,
-};
-
 static void
-move_selection(struct state *state, enum trappist_direction direction)
+select_item(struct state *state, struct menuitem *item)
 {
-	struct menu *menu = menu_from_item(state, state->selection);
-	assert(menu);
-	do {
-		struct menuitem *item = state->selection;
-		struct wl_list *list = direction == DIRECTION_UP
-			? state->selection->link.next
-			: state->selection->link.prev;
-		state->selection = wl_container_of(list, item, link);
-	} while (&state->selection->link == &menu->menuitems
-			|| !state->selection->selectable);
-	if (state->selection->submenu) {
-		open_submenu(state, state->selection);
+	if (!item) {
+		return;
+	}
+	cancel_prefetch(state, item);
+	state->selection = item;
+	scroll_to_item(item);
+	if (item->submenu) {
+		open_submenu(state, item);
 	} else {
-		close_all_submenus(menu);
+		close_all_submenus(item->menu);
 	}
 }
 
-struct menuitem *
-parent_of(struct state *state, struct menuitem *menuitem)
+/*
+ * Select the first item from the selection onwards whose label contains the
+ * search string, so that typing jumps through long lists. This is only done
+ * in lists from menu_init_list(), as selecting an item of other menus opens
+ * submenus and starts pipemenus.
+ */
+static void
+select_match(struct state *state)
 {
-	struct menu *child = menu_from_item(state, menuitem);
-	for (int i = 0; i < nr_menus; ++i) {
-		struct menu *menu = menus + i;
-		struct menuitem *item;
-		wl_list_for_each(item, &menu->menuitems, link) {
-			if (item->submenu == child) {
-				return item;
-			}
+	const char *needle = search_str();
+	struct menu *menu = state->selection->menu;
+	if (!menu->lazy) {
+		return;
+	}
+	for (int i = 0; i < menu->nr_items; i++) {
+		struct menuitem *item = menu->items[
+			(state->selection->index + i) % menu->nr_items];
+		if (item->selectable && item->label
+				&& strstr(item->label, needle)) {
+			select_item(state, item);
+			return;
 		}
 	}
-	return menuitem;
+}
+
+/* Number of items to skip on PageUp/PageDown */
+static int
+page_size(struct state *state)
+{
+	int nr = state->surface->height / MENU_ITEM_HEIGHT;
+	return nr > 1 ? nr - 1 : 1;
+}
+
+/*
+ * Move the selection by @offset items, skipping separators. Single steps
+ * wrap around whereas bigger ones stop at the first or last item.
+ */
+static void
+move_selection(struct state *state, int offset)
+{
+	struct menuitem *item = state->selection;
+	struct menu *menu = item->menu;
+	int step = offset < 0 ? -1 : 1;
+	if (offset == 1 || offset == -1) {
+		select_item(state, find_selectable(menu, item->index + step,
+			step, true));
+		return;
+	}
+	int index = item->index + offset;
+	index = index < 0 ? 0 : index;
+	index = index >= menu->nr_items ? menu->nr_items - 1 : index;
+	struct menuitem *target = find_selectable(menu, index, step, false);
+	if (!target) {
+		target = find_selectable(menu, index, -step, false);
+	}
+	select_item(state, target);
+}
+
+struct menuitem *
+parent_of(struct state *state, struct menuitem *menuitem)
+{
+	struct menuitem *opener = menuitem->menu->opener;
+	return opener ? opener : menuitem;
 }
 
 struct menuitem *
 child_of(struct state *state, struct menuitem *menuitem)
 {
-	struct menuitem *item;
-	struct wl_list *list = menuitem->submenu->menuitems.prev;
-	return wl_container_of(list, item, link);
+	struct menu *submenu = menuitem->submenu;
+	submenu->opener = menuitem;
+	struct menuitem *item = find_selectable(submenu, 0, 1, false);
+	return item ? item : menuitem;
 }
 
 void
@@ -797,14 +1979,31 @@ menu_handle_key(struct state *state, xkb_keysym_t keysym, uint32_t codepoint)
 {
 	if (!state->selection) {
 		state->selection = first_selectable_menuitem(state);
+		if (!state->selection) {
+			return;
+		}
 	}
 
 	switch (keysym) {
 	case XKB_KEY_Up:
-		move_selection(state, DIRECTION_UP);
+		move_selection(state, -1);
 		break;
 	case XKB_KEY_Down:
-		move_selection(state, DIRECTION_DOWN);
+		move_selection(state, 1);
+		break;
+	case XKB_KEY_Page_Up:
+		move_selection(state, -page_size(state));
+		break;
+	case XKB_KEY_Page_Down:
+		move_selection(state, page_size(state));
+		break;
+	case XKB_KEY_Home:
+		select_item(state, find_selectable(state->selection->menu, 0,
+			1, false));
+		break;
+	case XKB_KEY_End:
+		select_item(state, find_selectable(state->selection->menu,
+			state->selection->menu->nr_items - 1, -1, false));
 		break;
 	case XKB_KEY_Right:
 		if (state->selection->submenu) {
@@ -812,24 +2011,26 @@ menu_handle_key(struct state *state, xkb_keysym_t keysym, uint32_t codepoint)
 		}
 		break;
 	case XKB_KEY_Left:
+		cancel_prefetch(state, NULL);
 		state->selection = parent_of(state, state->selection);
 		break;
 	case XKB_KEY_KP_Enter:
 	case XKB_KEY_Return:
-		spawn_async_no_shell(state->selection->command);
-		state->run_display = false;
+		activate(state, state->selection);
 		break;
 	case XKB_KEY_BackSpace:
 		search_remove_last_uft8_character();
+		select_match(state);
 		break;
 	case XKB_KEY_Escape:
-		state->run_display = false;
+		menu_hide(state);
 		break;
 	default:
 		if (!codepoint) {
 			break;
 		}
 		search_add_utf8_character(codepoint);
+		select_match(state);
 		break;
 	}
 	surface_damage(state->surface);
@@ -1,7 +1,9 @@
 // SPDX-License-Identifier: GPL-2.0-only
 #define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
 #include <string.h>
 #include <sway-client-helpers/log.h>
+#include "menu.h"
 #include "trappist.h"
 
 static void
@@ -25,9 +27,10 @@ handle_wl_output_mode(void *data, struct wl_output *wl_output, uint32_t flags,
 }
 
 static void
-handle_wl_output_done(void *data, struct wl_output *output)
+handle_wl_output_done(void *data, struct wl_output *wl_output)
 {
-	/* nop */
+	struct output *output = data;
+	surface_prepare(output);
 }
 
 static void
@@ -64,12 +67,32 @@ static struct wl_output_listener output_listener = {
 };
 
 void
-output_init(struct state *state, struct wl_output *wl_output)
+output_init(struct state *state, struct wl_output *wl_output,
+		uint32_t global)
 {
 	struct output *output = calloc(1, sizeof(struct output));
 	output->state = state;
+	output->global = global;
 	output->wl_output = wl_output;
 	output->scale = 1;
 	wl_output_add_listener(output->wl_output, &output_listener, output);
 	wl_list_insert(&state->outputs, &output->link);
 }
+
+void
+output_destroy(struct output *output)
+{
+	struct state *state = output->state;
+	if (state->surface && state->surface->output == output) {
+		/* The menu cannot be shown here anymore */
+		state->surface->output = NULL;
+		if (state->surface->layer_surface) {
+			menu_hide(state);
+		}
+	}
+	surface_unprepare(output);
+	wl_list_remove(&output->link);
+	wl_output_release(output->wl_output);
+	free(output->name);
+	free(output);
+}
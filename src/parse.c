@@ -0,0 +1,574 @@
+// SPDX-License-Identifier: GPL-2.0-only
+#define _POSIX_C_SOURCE 200809L
+#include <assert.h>
+#include <fcntl.h>
+#include <libxml/parser.h>
+#include <libxml/parserInternals.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sway-client-helpers/log.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "apps.h"
+#include "catalog.h"
+#include "menu.h"
+#include "parse.h"
+#include "toplevels.h"
+
+/*
+ * Fields of an <item> can be given either as attributes or as child elements,
+ * for example <action command=""/> and <action><command></command></action>
+ * both set the command.
+ */
+enum field {
+	FIELD_NONE = 0,
+	FIELD_LABEL,
+	FIELD_ICON,
+	FIELD_ACTION,
+	FIELD_COMMAND,
+	FIELD_TRANSLATION,
+};
+
+/* <menu id=""/> item whose menu may be defined later in the file */
+struct reference {
+	struct menuitem *item;
+	const char *id;
+};
+
+struct parser {
+	struct menu *menu;
+	struct menuitem *item;
+	int menu_level;
+
+	/* element nesting depth and the depths of elements we care about */
+	int depth;
+	int item_depth;
+	int action_depth;
+	struct wl_array menu_depths;
+
+	/* text content of a field element, e.g. <command></command> */
+	enum field field;
+	int field_depth;
+	struct wl_array text;
+
+	/* xml:lang of a <label> element translating the item label */
+	char *lang;
+
+	/* struct reference, resolved once the whole file has been read */
+	struct wl_array references;
+
+	/*
+	 * Context for the ids of references in a stream, which are not interned
+	 * so that output read again and again does not grow the id table
+	 */
+	TALLOC_CTX *ids;
+};
+
+static bool
+is_blank(const char *s, size_t len)
+{
+	for (size_t i = 0; i < len; i++) {
+		if (s[i] != ' ' && s[i] != '\t' && s[i] != '\n' && s[i] != '\r') {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * libxml2 passes attributes as five pointers each: localname, prefix, URI,
+ * value and end of value. The value is not NUL-terminated.
+ */
+static char *
+attr_strdup(int nb_attributes, const xmlChar **attributes, const char *name)
+{
+	for (int i = 0; i < nb_attributes; i++) {
+		const xmlChar **attr = &attributes[i * 5];
+		if (!strcasecmp((const char *)attr[0], name)) {
+			return strndup((const char *)attr[3], attr[4] - attr[3]);
+		}
+	}
+	return NULL;
+}
+
+/* Value of the xml:lang attribute, or NULL */
+static char *
+lang_strdup(int nb_attributes, const xmlChar **attributes)
+{
+	for (int i = 0; i < nb_attributes; i++) {
+		const xmlChar **attr = &attributes[i * 5];
+		if (attr[2] && xmlStrEqual(attr[2], XML_XML_NAMESPACE)
+				&& !strcmp((const char *)attr[0], "lang")) {
+			return strndup((const char *)attr[3], attr[4] - attr[3]);
+		}
+	}
+	return NULL;
+}
+
+static enum field
+field_from_name(const char *name, bool in_action)
+{
+	if (in_action) {
+		if (!strcasecmp(name, "name")) {
+			return FIELD_ACTION;
+		}
+		if (!strcasecmp(name, "command") || !strcasecmp(name, "execute")) {
+			return FIELD_COMMAND;
+		}
+		return FIELD_NONE;
+	}
+	if (!strcasecmp(name, "label")) {
+		return FIELD_LABEL;
+	}
+	if (!strcasecmp(name, "icon")) {
+		return FIELD_ICON;
+	}
+	return FIELD_NONE;
+}
+
+/*
+ * Handle the following:
+ * <item label="" icon="">
+ *   <label xml:lang=""></label>
+ *   <action name="">
+ *     <command></command>
+ *   </action>
+ * </item>
+ */
+static void
+fill_item(struct parser *parser, enum field field, const char *content)
+{
+	/* <item label=""> defines the start of a new item */
+	if (field == FIELD_LABEL) {
+		parser->item = item_create(parser->menu, content);
+		return;
+	}
+	if (!parser->item) {
+		LOG(LOG_ERROR, "expect <item label=\"\"> element first");
+		return;
+	}
+	switch (field) {
+	case FIELD_ACTION:
+		parser->item->action = menu_strdup(content);
+		break;
+	case FIELD_COMMAND:
+		parser->item->command = menu_strdup(content);
+		break;
+	case FIELD_ICON:
+		parser->item->icon = menu_strdup(content);
+		break;
+	case FIELD_TRANSLATION:
+		if (parser->item->label) {
+			catalog_add(parser->item->label, parser->lang, content,
+				CATALOG_MENU_FILE);
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+static void
+fill_item_from_attributes(struct parser *parser, bool in_action,
+		int nb_attributes, const xmlChar **attributes)
+{
+	for (int i = 0; i < nb_attributes; i++) {
+		const xmlChar **attr = &attributes[i * 5];
+		enum field field = field_from_name((const char *)attr[0],
+			in_action);
+		size_t len = attr[4] - attr[3];
+		if (!field || is_blank((const char *)attr[3], len)) {
+			continue;
+		}
+		char *content = strndup((const char *)attr[3], len);
+		fill_item(parser, field, content);
+		free(content);
+	}
+}
+
+/*
+ * <menu> elements have three different roles:
+ *  * Definition of (sub)menu - has ID, LABEL and CONTENT
+ *  * Menuitem of pipemenu type - has EXECUTE and LABEL
+ *  * Menuitem of submenu type - has ID only
+ */
+static void
+handle_menu_element(struct parser *parser, int nb_attributes,
+		const xmlChar **attributes)
+{
+	char *label = attr_strdup(nb_attributes, attributes, "label");
+	char *execute = attr_strdup(nb_attributes, attributes, "execute");
+	char *id = attr_strdup(nb_attributes, attributes, "id");
+	char *icon = attr_strdup(nb_attributes, attributes, "icon");
+	char *ttl = attr_strdup(nb_attributes, attributes, "ttl");
+
+	if (execute && label && parser->menu) {
+		/* The pipemenu is filled in when it is opened */
+		parser->item = item_create(parser->menu, label);
+		if (icon) {
+			parser->item->icon = menu_strdup(icon);
+		}
+		struct menu *pipemenu = menu_create(id, label, parser->menu);
+		pipemenu->execute = menu_strdup(execute);
+		if (ttl && atoi(ttl) >= 0) {
+			pipemenu->ttl = atoi(ttl);
+		}
+		parser->item->submenu = pipemenu;
+	} else if (execute) {
+		LOG(LOG_ERROR, "pipemenu '%s' needs a label and a parent menu",
+			execute);
+	} else if (label && id) {
+		struct menu **submenu = NULL;
+		if (parser->menu_level > 0) {
+			/*
+			 * In a nested (inline) menu definition we need to
+			 * create an item pointing to the new submenu
+			 */
+			parser->item = item_create(parser->menu, label);
+			if (icon) {
+				parser->item->icon = menu_strdup(icon);
+			}
+			submenu = &parser->item->submenu;
+		}
+		++parser->menu_level;
+		parser->menu = menu_create(id, label, parser->menu);
+		if (submenu) {
+			*submenu = parser->menu;
+		}
+		int *depth = wl_array_add(&parser->menu_depths, sizeof(int));
+		*depth = parser->depth;
+	} else if (id && parser->menu) {
+		struct menu *menu = get_menu_by_id(id);
+		parser->item = item_create(parser->menu, menu ? menu->label : NULL);
+		parser->item->submenu = menu;
+		if (!menu) {
+			struct reference *ref = wl_array_add(&parser->references,
+				sizeof(*ref));
+			ref->item = parser->item;
+			ref->id = parser->ids ? talloc_strdup(parser->ids, id)
+				: menu_intern_id(id);
+		}
+	}
+	free(label);
+	free(execute);
+	free(id);
+	free(icon);
+	free(ttl);
+}
+
+/* This can be one of <separator> and <separator label=""> */
+static void
+handle_separator_element(struct parser *parser, int nb_attributes,
+		const xmlChar **attributes)
+{
+	if (!parser->menu) {
+		return;
+	}
+	char *label = attr_strdup(nb_attributes, attributes, "label");
+	parser->item = separator_create(parser->menu, label);
+	free(label);
+}
+
+static void
+handle_start_element(void *ctx, const xmlChar *localname,
+		const xmlChar *prefix, const xmlChar *uri, int nb_namespaces,
+		const xmlChar **namespaces, int nb_attributes, int nb_defaulted,
+		const xmlChar **attributes)
+{
+	struct parser *parser = ((xmlParserCtxt *)ctx)->_private;
+	const char *name = (const char *)localname;
+	++parser->depth;
+
+	if (!strcasecmp(name, "menu")) {
+		handle_menu_element(parser, nb_attributes, attributes);
+		return;
+	}
+	if (!strcasecmp(name, "separator")) {
+		handle_separator_element(parser, nb_attributes, attributes);
+		return;
+	}
+	if (!strcasecmp(name, "item")) {
+		if (!parser->menu) {
+			return;
+		}
+		parser->item = NULL;
+		parser->item_depth = parser->depth;
+		fill_item_from_attributes(parser, false, nb_attributes,
+			attributes);
+		return;
+	}
+	if (!parser->item_depth) {
+		return;
+	}
+
+	/* We are somewhere inside <item> */
+	bool in_action = parser->action_depth
+		&& parser->depth == parser->action_depth + 1;
+	bool in_item = parser->depth == parser->item_depth + 1;
+	if (in_item && !strcasecmp(name, "action")) {
+		parser->action_depth = parser->depth;
+		fill_item_from_attributes(parser, true, nb_attributes,
+			attributes);
+		return;
+	}
+	if (!in_item && !in_action) {
+		return;
+	}
+	parser->field = field_from_name(name, in_action);
+	parser->field_depth = parser->depth;
+	parser->text.size = 0;
+	if (parser->field == FIELD_LABEL) {
+		/* Labels in other languages follow the label, see catalog.h */
+		free(parser->lang);
+		parser->lang = lang_strdup(nb_attributes, attributes);
+		if (parser->lang) {
+			parser->field = FIELD_TRANSLATION;
+		}
+	}
+}
+
+static void
+handle_end_element(void *ctx, const xmlChar *localname,
+		const xmlChar *prefix, const xmlChar *uri)
+{
+	struct parser *parser = ((xmlParserCtxt *)ctx)->_private;
+
+	if (parser->field && parser->depth == parser->field_depth) {
+		if (!is_blank(parser->text.data, parser->text.size)) {
+			*(char *)wl_array_add(&parser->text, 1) = '\0';
+			fill_item(parser, parser->field, parser->text.data);
+		}
+		parser->field = FIELD_NONE;
+	}
+	if (parser->depth == parser->action_depth) {
+		parser->action_depth = 0;
+	}
+	if (parser->depth == parser->item_depth) {
+		parser->item_depth = 0;
+	}
+
+	int *depth = parser->menu_depths.size
+		? (int *)parser->menu_depths.data
+			+ parser->menu_depths.size / sizeof(int) - 1
+		: NULL;
+	if (depth && *depth == parser->depth) {
+		parser->menu_depths.size -= sizeof(int);
+		parser->menu = parser->menu->parent;
+		--parser->menu_level;
+	}
+	--parser->depth;
+}
+
+static void
+handle_characters(void *ctx, const xmlChar *ch, int len)
+{
+	struct parser *parser = ((xmlParserCtxt *)ctx)->_private;
+	if (!parser->field || parser->depth != parser->field_depth) {
+		return;
+	}
+	char *p = wl_array_add(&parser->text, len);
+	if (p) {
+		memcpy(p, ch, len);
+	}
+}
+
+/*
+ * Menus can be referenced before they are defined, so items pointing to
+ * menus which were not known at the time are fixed up at the end. Any that
+ * still do not resolve are dropped. Items of a stream may have been drawn
+ * already, so they are drawn again.
+ */
+static void
+resolve_references(struct parser *parser)
+{
+	struct reference *ref;
+	wl_array_for_each(ref, &parser->references) {
+		struct menu *menu = get_menu_by_id(ref->id);
+		if (!menu && !strcmp(ref->id, APPS_MENU_ID)) {
+			menu = apps_menu_create(ref->id);
+		} else if (!menu && !strcmp(ref->id, TOPLEVELS_MENU_ID)) {
+			menu = toplevels_menu_create(ref->id);
+		}
+		if (!menu) {
+			LOG(LOG_ERROR, "no menu with id '%s'", ref->id);
+			if (parser->ids) {
+				menu_item_destroy(ref->item);
+			} else {
+				item_remove(ref->item);
+			}
+			continue;
+		}
+		ref->item->label = menu->label;
+		ref->item->submenu = menu;
+		if (parser->ids) {
+			/* The hit testing data needs to know of the submenu */
+			ref->item->menu->layout.valid = false;
+			menu_item_changed(ref->item);
+		}
+	}
+}
+
+/*
+ * The SAX2 defaults are kept for the document and its DTD, so that entities
+ * declared there are known when substituted (XML_PARSE_NOENT). Elements and
+ * text are handled here instead of building a tree, and the parser state is
+ * in ctxt->_private, as callbacks get the parser context.
+ */
+static void
+sax_handler_init(xmlSAXHandler *sax)
+{
+	xmlSAXVersion(sax, 2);
+	sax->startElementNs = handle_start_element;
+	sax->endElementNs = handle_end_element;
+	sax->characters = handle_characters;
+	sax->ignorableWhitespace = handle_characters;
+	sax->cdataBlock = handle_characters;
+	sax->reference = NULL;
+	sax->comment = NULL;
+	sax->processingInstruction = NULL;
+}
+
+/* The document holds no more than the DTD, see sax_handler_init() */
+static void
+free_parser_ctxt(xmlParserCtxt *ctxt)
+{
+	xmlFreeDoc(ctxt->myDoc);
+	ctxt->myDoc = NULL;
+	xmlFreeParserCtxt(ctxt);
+}
+
+static void
+parser_init(struct parser *parser, struct menu *menu)
+{
+	*parser = (struct parser){ 0 };
+	wl_array_init(&parser->menu_depths);
+	wl_array_init(&parser->text);
+	wl_array_init(&parser->references);
+	if (menu) {
+		/* Elements at the top level belong to @menu */
+		parser->menu = menu;
+		parser->menu_level = 1;
+	}
+}
+
+static void
+parser_release(struct parser *parser)
+{
+	wl_array_release(&parser->menu_depths);
+	wl_array_release(&parser->text);
+	wl_array_release(&parser->references);
+	free(parser->lang);
+	talloc_free(parser->ids);
+}
+
+bool
+parse_file(const char *filename)
+{
+	assert(filename);
+	int fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		LOG_ERRNO(LOG_ERROR, "cannot open '%s'", filename);
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0 || st.st_size <= 0 || st.st_size > INT_MAX) {
+		LOG(LOG_ERROR, "cannot read '%s'", filename);
+		close(fd);
+		return false;
+	}
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		LOG_ERRNO(LOG_ERROR, "cannot mmap '%s'", filename);
+		return false;
+	}
+	bool ok = false;
+	posix_madvise(map, st.st_size, POSIX_MADV_SEQUENTIAL);
+
+	struct parser parser;
+	parser_init(&parser, NULL);
+
+	/* The memory parser context reads straight from the mapping */
+	xmlParserCtxt *ctxt = xmlCreateMemoryParserCtxt(map, st.st_size);
+	if (!ctxt) {
+		LOG(LOG_ERROR, "cannot create parser for '%s'", filename);
+		goto out;
+	}
+	sax_handler_init(ctxt->sax);
+	ctxt->_private = &parser;
+	xmlCtxtUseOptions(ctxt, XML_PARSE_NOENT | XML_PARSE_NONET);
+	if (xmlParseDocument(ctxt) || !ctxt->wellFormed) {
+		LOG(LOG_ERROR, "error parsing '%s'", filename);
+	} else {
+		ok = true;
+	}
+	free_parser_ctxt(ctxt);
+	resolve_references(&parser);
+out:
+	parser_release(&parser);
+	munmap(map, st.st_size);
+	return ok;
+}
+
+struct stream {
+	struct parser parser;
+	xmlParserCtxt *ctxt;
+};
+
+struct stream *
+parse_stream_create(struct menu *menu)
+{
+	struct stream *stream = calloc(1, sizeof(*stream));
+	if (!stream) {
+		return NULL;
+	}
+	parser_init(&stream->parser, menu);
+	stream->parser.ids = talloc_new(NULL);
+	xmlSAXHandler sax;
+	sax_handler_init(&sax);
+	stream->ctxt = xmlCreatePushParserCtxt(&sax, NULL, NULL, 0, NULL);
+	if (!stream->ctxt) {
+		LOG(LOG_ERROR, "cannot create push parser");
+		parser_release(&stream->parser);
+		free(stream);
+		return NULL;
+	}
+	stream->ctxt->_private = &stream->parser;
+	xmlCtxtUseOptions(stream->ctxt, XML_PARSE_NOENT | XML_PARSE_NONET);
+	return stream;
+}
+
+bool
+parse_stream_feed(struct stream *stream, const char *data, int len)
+{
+	return !xmlParseChunk(stream->ctxt, data, len, 0);
+}
+
+static void
+stream_destroy(struct stream *stream)
+{
+	free_parser_ctxt(stream->ctxt);
+	parser_release(&stream->parser);
+	free(stream);
+}
+
+bool
+parse_stream_finish(struct stream *stream)
+{
+	bool ok = !xmlParseChunk(stream->ctxt, NULL, 0, 1)
+		&& stream->ctxt->wellFormed;
+	resolve_references(&stream->parser);
+	stream_destroy(stream);
+	return ok;
+}
+
+void
+parse_stream_cancel(struct stream *stream)
+{
+	if (stream) {
+		stream_destroy(stream);
+	}
+}
@@ -0,0 +1,505 @@
+// SPDX-License-Identifier: GPL-2.0-only
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sway-client-helpers/log.h>
+#include <sway-client-helpers/loop.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <wayland-util.h>
+#include "conf.h"
+#include "menu.h"
+#include "parse.h"
+#include "pipemenu.h"
+#include "trappist.h"
+
+/*
+ * A pipemenu command whose output is being read, either straight into the
+ * menu or, when refreshing cached items, into @staging
+ */
+struct pipemenu_job {
+	struct state *state;
+	struct conf *conf;
+	struct menu *menu;
+	bool speculative;
+	struct menu *staging;
+	TALLOC_CTX *content;
+	pid_t pid;
+	int fd;
+	struct stream *stream;
+	struct loop_timer *timer;
+
+	/* items of @menu prepared for display so far, see handle_output() */
+	int nr_prepared;
+
+	struct wl_list link; /* jobs */
+};
+
+/*
+ * Running jobs, and pipemenus waiting for one to finish, which are only
+ * started while not @parked
+ */
+static struct wl_list jobs = { &jobs, &jobs };
+static int nr_jobs;
+static struct wl_array queue; /* struct menu *, NULL once started */
+static bool parked;
+
+/*
+ * Output is kept per command: the pipemenu which last ran a command, and
+ * holds its output, by the command. Other pipemenus with the same command
+ * take the output over from it when they need it.
+ */
+static GHashTable *outputs; /* char *, struct menu * */
+
+static void run_queue(struct conf *conf);
+
+/*
+ * Start @command with its stdout connected to a pipe and return the read end.
+ * As in spawn_async_no_shell(), a double-fork leaves the command orphaned, so
+ * it never needs to be waited for. The command leads a process group of its
+ * own, so that it can be killed along with its children through @pid, which
+ * the intermediate child reports back before it exits.
+ */
+static int
+spawn_with_output(const char *command, pid_t *pid)
+{
+	GError *err = NULL;
+	gchar **argv = NULL;
+	g_shell_parse_argv(command, NULL, &argv, &err);
+	if (err) {
+		LOG(LOG_ERROR, "pipemenu '%s': %s", command, err->message);
+		g_error_free(err);
+		return -1;
+	}
+
+	int fds[2], pid_fds[2];
+	if (pipe(fds) < 0) {
+		LOG_ERRNO(LOG_ERROR, "cannot create pipe");
+		g_strfreev(argv);
+		return -1;
+	}
+	if (pipe(pid_fds) < 0) {
+		LOG_ERRNO(LOG_ERROR, "cannot create pipe");
+		close(fds[0]);
+		close(fds[1]);
+		g_strfreev(argv);
+		return -1;
+	}
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+	fcntl(pid_fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(pid_fds[1], F_SETFD, FD_CLOEXEC);
+
+	pid_t child = fork();
+	switch (child) {
+	case -1:
+		LOG(LOG_ERROR, "unable to fork()");
+		close(fds[0]);
+		close(pid_fds[1]);
+		fds[0] = -1;
+		break;
+	case 0:
+		setsid();
+		sigset_t set;
+		sigemptyset(&set);
+		sigprocmask(SIG_SETMASK, &set, NULL);
+		int null = open("/dev/null", O_RDONLY);
+		if (null > STDIN_FILENO) {
+			dup2(null, STDIN_FILENO);
+			close(null);
+		}
+		dup2(fds[1], STDOUT_FILENO);
+		pid_t grandchild = fork();
+		if (grandchild == 0) {
+			setpgid(0, 0);
+			execvp(argv[0], argv);
+			_exit(1);
+		}
+		/* Both set the group, so that it exists once @pid is known */
+		if (grandchild > 0) {
+			setpgid(grandchild, grandchild);
+		}
+		_exit(write(pid_fds[1], &grandchild, sizeof(grandchild))
+			!= sizeof(grandchild));
+	default:
+		close(pid_fds[1]);
+		if (read(pid_fds[0], pid, sizeof(*pid)) != sizeof(*pid)
+				|| *pid < 0) {
+			LOG(LOG_ERROR, "unable to fork()");
+			close(fds[0]);
+			fds[0] = -1;
+		}
+		waitpid(child, NULL, 0);
+		break;
+	}
+	close(fds[1]);
+	close(pid_fds[0]);
+	g_strfreev(argv);
+	return fds[0];
+}
+
+static void
+job_destroy(struct pipemenu_job *job, bool kill_command)
+{
+	if (kill_command) {
+		kill(-job->pid, SIGTERM);
+	}
+	if (job->timer) {
+		loop_remove_timer(job->state->eventloop, job->timer);
+	}
+	loop_remove_fd(job->state->eventloop, job->fd);
+	close(job->fd);
+	parse_stream_cancel(job->stream);
+	if (job->staging) {
+		talloc_free(job->content);
+	}
+	job->menu->job = NULL;
+	wl_list_remove(&job->link);
+	struct conf *conf = job->conf;
+	free(job);
+	--nr_jobs;
+	run_queue(conf);
+}
+
+static void
+handle_output(int fd, short mask, void *data)
+{
+	struct pipemenu_job *job = data;
+	struct menu *menu = job->menu;
+	char buf[4096];
+	bool done = false, ok = false;
+
+	menu_alloc_from(job->content);
+	for (;;) {
+		ssize_t len = read(fd, buf, sizeof(buf));
+		if (len > 0) {
+			if (!parse_stream_feed(job->stream, buf, len)) {
+				LOG(LOG_ERROR, "pipemenu '%s': invalid output",
+					menu->execute);
+				done = true;
+				break;
+			}
+			continue;
+		}
+		if (len < 0 && errno == EINTR) {
+			continue;
+		}
+		if (len < 0 && errno == EAGAIN) {
+			break;
+		}
+		/* End of output */
+		ok = parse_stream_finish(job->stream);
+		if (!ok) {
+			LOG(LOG_ERROR, "pipemenu '%s': invalid output",
+				menu->execute);
+		}
+		job->stream = NULL;
+		done = true;
+		break;
+	}
+	if (!job->staging && done) {
+		menu_items_added(menu);
+	} else if (!job->staging) {
+		/* Only items read since the last time are new */
+		menu_items_appended(menu, job->nr_prepared);
+		job->nr_prepared = menu->nr_items;
+	}
+	menu_alloc_from(NULL);
+
+	if (!done) {
+		return;
+	}
+	if (ok) {
+		menu->fetched = g_get_monotonic_time();
+	}
+	if (ok && job->staging) {
+		/* Swap in the refreshed items, unless nothing has changed */
+		if (menu_replace_items(menu, job->staging)) {
+			talloc_free(menu->content);
+			menu->content = job->content;
+			job->content = NULL;
+			menu_items_added(menu);
+		}
+	}
+	job_destroy(job, false);
+}
+
+static void
+handle_timeout(void *data)
+{
+	struct pipemenu_job *job = data;
+	job->timer = NULL;
+	LOG(LOG_ERROR, "pipemenu '%s' timed out", job->menu->execute);
+	job_destroy(job, true);
+}
+
+static bool
+is_fresh(struct menu *menu, struct conf *conf)
+{
+	if (!menu->fetched) {
+		return false;
+	}
+	int ttl = menu->ttl >= 0 ? menu->ttl : conf->pipemenu.ttl;
+	return g_get_monotonic_time() - menu->fetched
+		< (int64_t)ttl * G_USEC_PER_SEC;
+}
+
+struct menu *
+pipemenu_holder(struct menu *menu)
+{
+	struct menu *holder = outputs
+		? g_hash_table_lookup(outputs, menu->execute) : NULL;
+	return holder ? holder : menu;
+}
+
+static void
+set_holder(struct menu *menu)
+{
+	if (!outputs) {
+		outputs = g_hash_table_new_full(g_str_hash, g_str_equal,
+			g_free, NULL);
+	}
+	g_hash_table_insert(outputs, g_strdup(menu->execute), menu);
+}
+
+/*
+ * Take the output of the command of @menu over from another pipemenu, so
+ * that it is run and kept once however many pipemenus share it. That cannot
+ * be done while the other one is open or its command is first filling it,
+ * in which case false is returned.
+ */
+static bool
+take_output(struct menu *menu)
+{
+	struct menu *holder = pipemenu_holder(menu);
+	if (holder == menu) {
+		return true;
+	}
+	if (holder->visible || (holder->job && !holder->job->staging)) {
+		return false;
+	}
+	pipemenu_adopt(menu, holder);
+	return true;
+}
+
+static void
+start_job(struct state *state, struct menu *menu, struct conf *conf,
+		bool speculative)
+{
+	struct pipemenu_job *job = calloc(1, sizeof(*job));
+	if (!job) {
+		return;
+	}
+	job->content = talloc_new(NULL);
+	if (menu->fetched) {
+		/* Keep showing the cached items while they are refreshed */
+		menu_alloc_from(job->content);
+		job->staging = menu_create(NULL, menu->label, menu->parent);
+		menu_alloc_from(NULL);
+		job->staging->state = state;
+	} else {
+		pipemenu_clear(menu);
+		menu->content = job->content;
+	}
+	job->fd = spawn_with_output(menu->execute, &job->pid);
+	if (job->fd >= 0) {
+		job->stream = parse_stream_create(job->staging
+			? job->staging : menu);
+	}
+	if (!job->stream) {
+		if (job->fd >= 0) {
+			kill(-job->pid, SIGTERM);
+			close(job->fd);
+		}
+		if (job->staging) {
+			talloc_free(job->content);
+		}
+		free(job);
+		return;
+	}
+	job->state = state;
+	job->conf = conf;
+	job->menu = menu;
+	job->speculative = speculative;
+	menu->job = job;
+	set_holder(menu);
+	wl_list_insert(&jobs, &job->link);
+	++nr_jobs;
+	loop_add_fd(state->eventloop, job->fd, POLLIN, handle_output, job);
+	if (conf->pipemenu.timeout > 0) {
+		job->timer = loop_add_timer(state->eventloop,
+			conf->pipemenu.timeout, handle_timeout, job);
+	}
+}
+
+static void
+unqueue(struct menu *menu)
+{
+	struct menu **queued;
+	wl_array_for_each(queued, &queue) {
+		if (*queued == menu) {
+			*queued = NULL;
+		}
+	}
+}
+
+static void
+run_queue(struct conf *conf)
+{
+	/* Starting a job can end others, which would get here again */
+	static bool running;
+	if (running || parked) {
+		return;
+	}
+	running = true;
+	bool pending = false;
+	struct menu **queued;
+	wl_array_for_each(queued, &queue) {
+		struct menu *menu = *queued;
+		if (menu && nr_jobs < conf->pipemenu.jobs) {
+			*queued = NULL;
+			menu = pipemenu_holder(menu);
+			if (!menu->job && !is_fresh(menu, conf)) {
+				start_job(menu->state, menu, conf, false);
+			}
+		}
+		pending |= *queued != NULL;
+	}
+	if (!pending) {
+		wl_array_release(&queue);
+		wl_array_init(&queue);
+	}
+	running = false;
+}
+
+void
+pipemenu_run(struct state *state, struct menu *menu, struct conf *conf)
+{
+	unqueue(menu);
+	if (!take_output(menu)) {
+		/* Rare enough that the command is run for each of them */
+		start_job(state, menu, conf, false);
+		return;
+	}
+	if (menu->job) {
+		/* The menu is being opened, so keep its prefetch going */
+		menu->job->speculative = false;
+		return;
+	}
+	if (!is_fresh(menu, conf)) {
+		start_job(state, menu, conf, false);
+	}
+}
+
+void
+pipemenu_prefetch(struct state *state, struct menu *menu, struct conf *conf)
+{
+	menu = pipemenu_holder(menu);
+	if (conf->pipemenu.prefetch == PIPEMENU_PREFETCH_NONE || menu->job
+			|| nr_jobs >= conf->pipemenu.jobs
+			|| is_fresh(menu, conf)) {
+		return;
+	}
+	start_job(state, menu, conf, true);
+}
+
+void
+pipemenu_cancel_prefetch(struct menu *menu)
+{
+	menu = pipemenu_holder(menu);
+	if (menu->job && menu->job->speculative) {
+		job_destroy(menu->job, true);
+	}
+}
+
+void
+pipemenu_park(void)
+{
+	parked = true;
+	struct pipemenu_job *job, *tmp;
+	wl_list_for_each_safe(job, tmp, &jobs, link) {
+		/* Prefetches are for a menu about to be opened, so not resumed */
+		if (!job->speculative) {
+			struct menu **queued = wl_array_add(&queue,
+				sizeof(*queued));
+			if (queued) {
+				*queued = job->menu;
+			}
+		}
+		job_destroy(job, true);
+	}
+}
+
+void
+pipemenu_resume(struct conf *conf)
+{
+	parked = false;
+	run_queue(conf);
+}
+
+void
+pipemenu_enqueue(struct menu *menu, struct conf *conf)
+{
+	struct menu **queued = wl_array_add(&queue, sizeof(*queued));
+	if (queued) {
+		*queued = menu;
+	}
+	run_queue(conf);
+}
+
+void
+pipemenu_cancel(struct menu *menu)
+{
+	unqueue(menu);
+	if (menu->job) {
+		job_destroy(menu->job, true);
+	}
+}
+
+void
+pipemenu_clear(struct menu *menu)
+{
+	pipemenu_cancel(menu);
+	menu_remove_items(menu);
+	talloc_free(menu->content);
+	menu->content = NULL;
+	menu->fetched = 0;
+	if (outputs && g_hash_table_lookup(outputs, menu->execute) == menu) {
+		g_hash_table_remove(outputs, menu->execute);
+	}
+}
+
+void
+pipemenu_adopt(struct menu *menu, struct menu *old)
+{
+	unqueue(old);
+	struct pipemenu_job *job = old->job;
+	if (job && !(job->staging && old->content)) {
+		job_destroy(job, true);
+		job = NULL;
+	}
+	if (!old->content) {
+		pipemenu_clear(old);
+		return;
+	}
+	pipemenu_clear(menu);
+	menu_replace_items(menu, old);
+	menu->content = old->content;
+	menu->fetched = old->fetched;
+	old->content = NULL;
+	old->fetched = 0;
+	if (job) {
+		/* A refresh carries on for @menu */
+		old->job = NULL;
+		job->menu = menu;
+		job->staging->parent = menu;
+		menu->job = job;
+	}
+	set_holder(menu);
+}
@@ -3,11 +3,14 @@
 #include <assert.h>
 #include <cairo.h>
 #include <ctype.h>
+#include <dlfcn.h>
 #include <glib.h>
+#include <inttypes.h>
 #include <librsvg/rsvg.h>
 #include <libxml/parser.h>
 #include <libxml/tree.h>
 #include <pango/pangocairo.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -22,12 +25,60 @@
 #include "menu.h"
 #include "trappist.h"
 
+#define RSVG_LIBRARY "librsvg-2.so.2"
+
+/*
+ * librsvg and the libraries it pulls in take a while to load, so it is opened
+ * for the first svg icon rather than at startup. It stays loaded, as it
+ * registers types with GObject which cannot be unloaded.
+ */
+static struct {
+	bool tried;
+	void *library;
+	RsvgHandle *(*handle_new_from_file)(const char *filename,
+		GError **error);
+	gboolean (*handle_render_document)(RsvgHandle *handle, cairo_t *cr,
+		const RsvgRectangle *viewport, GError **error);
+} rsvg;
+
+static bool
+rsvg_load(void)
+{
+	if (rsvg.tried) {
+		return rsvg.library;
+	}
+	rsvg.tried = true;
+	int64_t start = g_get_monotonic_time();
+	rsvg.library = dlopen(RSVG_LIBRARY, RTLD_NOW | RTLD_LOCAL);
+	if (!rsvg.library) {
+		LOG(LOG_ERROR, "no svg icons without %s", dlerror());
+		return false;
+	}
+	rsvg.handle_new_from_file = dlsym(rsvg.library,
+		"rsvg_handle_new_from_file");
+	rsvg.handle_render_document = dlsym(rsvg.library,
+		"rsvg_handle_render_document");
+	if (!rsvg.handle_new_from_file || !rsvg.handle_render_document) {
+		LOG(LOG_ERROR, "no svg icons with %s older than 2.46",
+			RSVG_LIBRARY);
+		dlclose(rsvg.library);
+		rsvg.library = NULL;
+		return false;
+	}
+	LOG(LOG_INFO, "loaded %s in %" PRId64 " us", RSVG_LIBRARY,
+		g_get_monotonic_time() - start);
+	return true;
+}
+
 static void
 add_svg(cairo_t *cairo, const char *filename, int icon_size)
 {
+	if (!rsvg_load()) {
+		return;
+	}
 	GError *err = NULL;
 	RsvgRectangle viewport = { .width = icon_size, .height = icon_size };
-	RsvgHandle *svg = rsvg_handle_new_from_file(filename, &err);
+	RsvgHandle *svg = rsvg.handle_new_from_file(filename, &err);
 	if (err) {
 		LOG(LOG_DEBUG, "error reading svg %s-%s", filename, err->message);
 		g_error_free(err);
@@ -38,7 +89,7 @@ add_svg(cairo_t *cairo, const char *filename, int icon_size)
 		icon_size, icon_size);
 	cairo_t *cr = cairo_create(image);
 
-	rsvg_handle_render_document(svg, cr, &viewport, &err);
+	rsvg.handle_render_document(svg, cr, &viewport, &err);
 	if (err) {
 		LOG(LOG_ERROR, "error rendering svg %s-%s\n", filename, err->message);
 		g_error_free(err);
@@ -158,9 +209,52 @@ pixmap_create(cairo_surface_t **pixmap, struct box *box)
 			box->width, box->height);
 }
 
+static pthread_t warmup_thread;
+static bool warming_up;
+
+/*
+ * Runs on its own thread. Font maps are per thread, so this one is thrown
+ * away, but fontconfig and its caches are loaded once for the whole process.
+ */
+static void *
+warmup_worker(void *data)
+{
+	PangoFontMap *map = pango_cairo_font_map_new();
+	PangoContext *pango = pango_font_map_create_context(map);
+	PangoFontDescription *description =
+		pango_font_description_from_string(MENU_FONT);
+	PangoFont *font = pango_context_load_font(pango, description);
+	if (font) {
+		g_object_unref(font);
+	}
+	pango_font_description_free(description);
+	g_object_unref(pango);
+	g_object_unref(map);
+	return NULL;
+}
+
+void
+pixmap_warmup(void)
+{
+	if (!warming_up) {
+		warming_up = !pthread_create(&warmup_thread, NULL,
+			warmup_worker, NULL);
+	}
+}
+
+void
+pixmap_warmup_finish(void)
+{
+	if (warming_up) {
+		pthread_join(warmup_thread, NULL);
+		warming_up = false;
+	}
+}
+
 void
 pixmap_pair_create(struct menuitem *item, struct conf *conf)
 {
+	pixmap_warmup_finish();
 	pixmap_create(&item->pixmap.active, &item->box);
 	pixmap_create(&item->pixmap.inactive, &item->box);
 
@@ -1,5 +1,6 @@
 // SPDX-License-Identifier: GPL-2.0-only
 #include <cairo.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <sway-client-helpers/util.h>
@@ -32,21 +33,31 @@ draw_pixmap(cairo_t *cairo, cairo_surface_t *pixmap, struct box *box)
 static void
 draw_menu(cairo_t *cairo, struct menu *menu)
 {
-	if (!menu->visible) {
-		return;
-	}
-
 	/* background */
 	draw_rect(cairo, &menu->box, COLOR_MENU_BG, true);
 
 	/* border */
 	draw_rect(cairo, &menu->box, COLOR_MENU_BORDER, false);
 
-	struct menuitem *menuitem;
-	wl_list_for_each(menuitem, &menu->menuitems, link) {
+	/* Items of a scrolled menu are clipped to it, so draw only those */
+	cairo_save(cairo);
+	cairo_rectangle(cairo, menu->box.x, menu->box.y + MENU_PADDING_Y,
+		menu->box.width, menu->box.height - 2 * MENU_PADDING_Y);
+	cairo_clip(cairo);
+	cairo_translate(cairo, 0, -menu->scroll);
+	int top = menu->box.y + menu->scroll;
+	int bottom = top + menu->box.height;
+	for (int i = 0; i < menu->nr_items; i++) {
+		struct menuitem *menuitem = menu->items[i];
 		cairo_surface_t *pixmap;
 		uint32_t color_item_bg;
 
+		if (menuitem->box.y + menuitem->box.height <= top) {
+			continue;
+		}
+		if (menuitem->box.y >= bottom) {
+			break;
+		}
 		if (menuitem != menu->state->selection) {
 			pixmap = menuitem->pixmap.inactive;
 			color_item_bg = COLOR_ITEM_INACTIVE_BG;
@@ -55,11 +66,11 @@ draw_menu(cairo_t *cairo, struct menu *menu)
 			color_item_bg = COLOR_ITEM_ACTIVE_BG;
 		}
 		draw_rect(cairo, &menuitem->box, color_item_bg, true);
-		draw_pixmap(cairo, pixmap, &menuitem->box);
-		if (menuitem->submenu && menuitem->submenu->visible) {
-			draw_menu(cairo, menuitem->submenu);
+		if (pixmap) {
+			draw_pixmap(cairo, pixmap, &menuitem->box);
 		}
 	}
+	cairo_restore(cairo);
 }
 
 static void
@@ -72,7 +83,11 @@ draw(cairo_t *cairo, struct state *state)
 	cairo_paint(cairo);
 	cairo_restore(cairo);
 
-	draw_menu(cairo, state->menu);
+	/* Open menus from the root down, so that submenus end up on top */
+	struct menu **menu;
+	wl_array_for_each(menu, &state->open_menus) {
+		draw_menu(cairo, *menu);
+	}
 }
 
 void
@@ -83,20 +98,59 @@ render_frame(struct surface *surface)
 	if (!surface_is_configured(surface)) {
 		return;
 	}
+
+	/* Buffers match the scale of the output, drawn on in surface units */
+	int scale = surface->output ? surface->output->scale : 1;
+	uint32_t width = surface->width * scale;
+	uint32_t height = surface->height * scale;
+
+	/* Buffers of another size are created anew, so nothing is left of them */
+	for (int i = 0; i < 2; i++) {
+		if (surface->buffers[i].width != width
+				|| surface->buffers[i].height != height) {
+			surface->damage[i].full = true;
+		}
+	}
 	struct pool_buffer *buffer = get_next_buffer(state->shm,
-		surface->buffers, surface->width, surface->height);
+		surface->buffers, width, height);
 	if (!buffer) {
 		return;
 	}
+	int index = buffer - surface->buffers;
+	bool full = surface->damage[index].full;
+	struct wl_array *rects = &surface->damage[index].rects;
 
 	cairo_t *cairo = buffer->cairo;
 	cairo_set_antialias(cairo, CAIRO_ANTIALIAS_BEST);
 	cairo_identity_matrix(cairo);
+	cairo_scale(cairo, scale, scale);
 
+	/* Only draw what has changed since this buffer was last attached */
+	cairo_rectangle_int_t *rect;
+	if (!full) {
+		wl_array_for_each(rect, rects) {
+			cairo_rectangle(cairo, rect->x, rect->y, rect->width,
+				rect->height);
+		}
+		cairo_clip(cairo);
+	}
 	draw(cairo, state);
+	cairo_reset_clip(cairo);
 
 	/* https://wayland-book.com/surfaces/shared-memory.html */
+	wl_surface_set_buffer_scale(surface->surface, scale);
 	wl_surface_attach(surface->surface, buffer->buffer, 0, 0);
-	wl_surface_damage_buffer(surface->surface, 0, 0, INT32_MAX, INT32_MAX);
+	if (full) {
+		wl_surface_damage_buffer(surface->surface, 0, 0, INT32_MAX,
+			INT32_MAX);
+	} else {
+		wl_array_for_each(rect, rects) {
+			wl_surface_damage_buffer(surface->surface,
+				rect->x * scale, rect->y * scale,
+				rect->width * scale, rect->height * scale);
+		}
+	}
 	wl_surface_commit(surface->surface);
+	surface->damage[index].full = false;
+	rects->size = 0;
 }
@@ -61,3 +61,10 @@ search_str(void)
 {
 	return buffer.data;
 }
+
+void
+search_clear(void)
+{
+	buffer.len = 0;
+	buffer.data[0] = 0;
+}
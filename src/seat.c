@@ -9,6 +9,9 @@
 #include "trappist.h"
 #include "menu.h"
 
+/* Distance scrolled per mouse wheel click */
+#define SCROLL_STEP (3 * MENU_ITEM_HEIGHT)
+
 /*
  * Rigged up using references:
  *   - https://wayland.freedesktop.org/docs/html/apa.html
@@ -56,7 +59,12 @@ static void
 handle_wl_keyboard_leave(void *data, struct wl_keyboard *wl_keyboard,
 		uint32_t serial, struct wl_surface *surface)
 {
-	/* nop */
+	/* A hidden menu must not see repeated keys */
+	struct seat *seat = data;
+	if (seat->repeat_timer) {
+		loop_remove_timer(seat->state->eventloop, seat->repeat_timer);
+		seat->repeat_timer = NULL;
+	}
 }
 
 static void
@@ -136,8 +144,10 @@ static void
 update_cursor(struct seat *seat, uint32_t serial)
 {
 	struct state *state = seat->state;
-	seat->cursor_theme =
-		wl_cursor_theme_load(getenv("XCURSOR_THEME"), 24, state->shm);
+	if (!seat->cursor_theme) {
+		seat->cursor_theme = wl_cursor_theme_load(
+			getenv("XCURSOR_THEME"), 24, state->shm);
+	}
 	struct wl_cursor *cursor =
 		wl_cursor_theme_get_cursor(seat->cursor_theme, "left_ptr");
 	struct wl_cursor_image *cursor_image = cursor->images[0];
@@ -249,6 +259,9 @@ handle_wl_pointer_frame(void *data, struct wl_pointer *wl_pointer)
 		menu_handle_cursor_motion(seat->state->menu,
 			seat->pointer_x, seat->pointer_y);
 	}
+	if (event->event_mask & POINTER_EVENT_LEAVE) {
+		menu_handle_pointer_leave(seat->state);
+	}
 
 	if (event->event_mask & POINTER_EVENT_BUTTON) {
 		int x = seat->pointer_x;
@@ -263,6 +276,17 @@ handle_wl_pointer_frame(void *data, struct wl_pointer *wl_pointer)
 		default:
 		}
 	}
+	if (event->event_mask & POINTER_EVENT_AXIS) {
+		/* Wheels scroll by whole items, touchpads by pixels */
+		int axis = WL_POINTER_AXIS_VERTICAL_SCROLL;
+		int dy = event->axes[axis].discrete
+			? event->axes[axis].discrete * SCROLL_STEP
+			: wl_fixed_to_int(event->axes[axis].value);
+		if (dy) {
+			menu_handle_scroll(seat->state, seat->pointer_x,
+				seat->pointer_y, dy);
+		}
+	}
 	memset(event, 0, sizeof(struct pointer_event));
 	surface_damage(seat->state->surface);
 }
@@ -319,6 +343,7 @@ seat_init(struct state *state, struct wl_seat *wl_seat)
 {
 	struct seat *seat = calloc(1, sizeof(struct seat));
 	seat->state = state;
+	seat->wl_seat = wl_seat;
 	state->seat = seat;
 	wl_seat_add_listener(wl_seat, &seat_listener, seat);
 }
@@ -2,6 +2,9 @@
 #define _POSIX_C_SOURCE 200809L
 #include <assert.h>
 #include <stdio.h>
+#include <string.h>
+#include <sway-client-helpers/log.h>
+#include "menu.h"
 #include "trappist.h"
 #include "wlr-layer-shell-unstable-v1-client-protocol.h"
 
@@ -11,18 +14,41 @@ static void
 layer_surface_configure(void *data, struct zwlr_layer_surface_v1 *layer_surface,
 		uint32_t serial, uint32_t width, uint32_t height)
 {
-	struct surface *surface = data;
-	surface->width = width;
-	surface->height = height;
+	struct state *state = data;
+	struct surface *surface = state->surface;
 	zwlr_layer_surface_v1_ack_configure(layer_surface, serial);
-	render_frame(surface);
+	if (layer_surface == surface->layer_surface) {
+		surface->width = width;
+		surface->height = height;
+		menu_handle_configure(state);
+		render_frame(surface);
+		return;
+	}
+
+	/* Nothing is drawn on a surface made ready ahead of time */
+	struct output *output;
+	wl_list_for_each(output, &state->outputs, link) {
+		if (layer_surface == output->ready.layer_surface) {
+			output->ready.width = width;
+			output->ready.height = height;
+		}
+	}
 }
 
 static void
 layer_surface_closed(void *data, struct zwlr_layer_surface_v1 *layer_surface)
 {
-	struct surface *surface = data;
-	surface_destroy(surface);
+	struct state *state = data;
+	if (layer_surface == state->surface->layer_surface) {
+		menu_hide(state);
+		return;
+	}
+	struct output *output;
+	wl_list_for_each(output, &state->outputs, link) {
+		if (layer_surface == output->ready.layer_surface) {
+			surface_unprepare(output);
+		}
+	}
 }
 
 static const struct zwlr_layer_surface_v1_listener layer_surface_listener = {
@@ -30,29 +56,120 @@ static const struct zwlr_layer_surface_v1_listener layer_surface_listener = {
 	.closed = layer_surface_closed,
 };
 
-void
-surface_layer_surface_create(struct surface *surface)
+/* Make @surface a layer surface on @wl_output, or where the compositor likes */
+static struct zwlr_layer_surface_v1 *
+layer_surface_create(struct state *state, struct wl_surface *surface,
+		struct wl_output *wl_output)
 {
-	struct state *state = surface->state;
-
-	assert(surface->surface);
-	surface->layer_surface = zwlr_layer_shell_v1_get_layer_surface(
-		state->layer_shell, surface->surface, surface->wl_output,
-		ZWLR_LAYER_SHELL_V1_LAYER_TOP, "trappist");
-	assert(surface->layer_surface);
+	struct zwlr_layer_surface_v1 *layer_surface =
+		zwlr_layer_shell_v1_get_layer_surface(state->layer_shell,
+			surface, wl_output, ZWLR_LAYER_SHELL_V1_LAYER_TOP,
+			"trappist");
+	assert(layer_surface);
 
-	zwlr_layer_surface_v1_set_size(surface->layer_surface, 0, 0);
-	zwlr_layer_surface_v1_set_anchor(surface->layer_surface,
+	zwlr_layer_surface_v1_set_size(layer_surface, 0, 0);
+	zwlr_layer_surface_v1_set_anchor(layer_surface,
 			ZWLR_LAYER_SURFACE_V1_ANCHOR_TOP |
 			ZWLR_LAYER_SURFACE_V1_ANCHOR_RIGHT |
 			ZWLR_LAYER_SURFACE_V1_ANCHOR_BOTTOM |
 			ZWLR_LAYER_SURFACE_V1_ANCHOR_LEFT);
-	zwlr_layer_surface_v1_set_exclusive_zone(surface->layer_surface, -1);
-	zwlr_layer_surface_v1_set_keyboard_interactivity(surface->layer_surface,
+	zwlr_layer_surface_v1_set_exclusive_zone(layer_surface, -1);
+	zwlr_layer_surface_v1_set_keyboard_interactivity(layer_surface,
 		ZWLR_LAYER_SURFACE_V1_KEYBOARD_INTERACTIVITY_ON_DEMAND);
-	zwlr_layer_surface_v1_add_listener(surface->layer_surface,
-			&layer_surface_listener, surface);
-	wl_surface_commit(surface->surface);
+	zwlr_layer_surface_v1_add_listener(layer_surface,
+			&layer_surface_listener, state);
+
+	/* Committed without a buffer, so it is configured but not mapped */
+	wl_surface_commit(surface);
+	return layer_surface;
+}
+
+void
+surface_prepare(struct output *output)
+{
+	struct state *state = output->state;
+	struct surface *surface = state->surface;
+	if (output->ready.layer_surface || !state->layer_shell) {
+		return;
+	}
+	if (surface && surface->output == output && surface->layer_surface) {
+		/* The menu is shown here already */
+		return;
+	}
+	output->ready.surface = wl_compositor_create_surface(state->compositor);
+	assert(output->ready.surface);
+	output->ready.layer_surface = layer_surface_create(state,
+		output->ready.surface, output->wl_output);
+}
+
+void
+surface_unprepare(struct output *output)
+{
+	if (output->ready.layer_surface) {
+		zwlr_layer_surface_v1_destroy(output->ready.layer_surface);
+	}
+	if (output->ready.surface) {
+		wl_surface_destroy(output->ready.surface);
+	}
+	memset(&output->ready, 0, sizeof(output->ready));
+}
+
+void
+surface_map(struct surface *surface)
+{
+	struct state *state = surface->state;
+	struct output *output = surface->output;
+	if (surface->layer_surface) {
+		return;
+	}
+	if (!output) {
+		surface->surface = wl_compositor_create_surface(
+			state->compositor);
+		assert(surface->surface);
+		surface->layer_surface = layer_surface_create(state,
+			surface->surface, NULL);
+		return;
+	}
+
+	surface_prepare(output);
+	surface->surface = output->ready.surface;
+	surface->layer_surface = output->ready.layer_surface;
+	surface->width = output->ready.width;
+	surface->height = output->ready.height;
+	memset(&output->ready, 0, sizeof(output->ready));
+
+	/* Configured ahead of time, so the first frame can be drawn now */
+	if (surface_is_configured(surface)) {
+		menu_handle_configure(state);
+		render_frame(surface);
+	}
+}
+
+bool
+surface_set_output(struct surface *surface, const char *name)
+{
+	struct state *state = surface->state;
+	struct output *output = surface->output;
+	if (name) {
+		struct output *named = NULL;
+		wl_list_for_each(output, &state->outputs, link) {
+			if (output->name && !strcmp(output->name, name)) {
+				named = output;
+			}
+		}
+		if (!named) {
+			LOG(LOG_ERROR, "no output '%s'", name);
+			return false;
+		}
+		output = named;
+	} else if (!output && !wl_list_empty(&state->outputs)) {
+		output = wl_container_of(state->outputs.next, output, link);
+	}
+	if (output != surface->output) {
+		surface_unmap(surface);
+		surface->output = output;
+	}
+	return true;
 }
 
 static const struct wl_callback_listener surface_frame_listener;
@@ -63,13 +180,13 @@ surface_frame_done(void *data, struct wl_callback *callback, uint32_t time)
 	struct surface *surface = data;
 
 	wl_callback_destroy(callback);
-	surface->frame_pending = false;
+	surface->frame = NULL;
 	if (!surface->dirty) {
 		return;
 	}
-	struct wl_callback *_callback = wl_surface_frame(surface->surface);
-	wl_callback_add_listener(_callback, &surface_frame_listener, surface);
-	surface->frame_pending = true;
+	surface->frame = wl_surface_frame(surface->surface);
+	wl_callback_add_listener(surface->frame, &surface_frame_listener,
+		surface);
 	render_frame(surface);
 	surface->dirty = false;
 }
@@ -84,32 +201,120 @@ surface_is_configured(struct surface *surface)
 	return (surface->width && surface->height);
 }
 
+/* Past this many rectangles, buffers are drawn again as a whole */
+#define SURFACE_MAX_DAMAGE_RECTS (32)
+
+static void
+schedule_frame(struct surface *surface)
+{
+	surface->dirty = true;
+	if (surface->frame) {
+		return;
+	}
+	surface->frame = wl_surface_frame(surface->surface);
+	wl_callback_add_listener(surface->frame, &surface_frame_listener,
+		surface);
+	wl_surface_commit(surface->surface);
+}
+
 void
 surface_damage(struct surface *surface)
 {
 	if (!surface_is_configured(surface)) {
 		return;
 	}
-	surface->dirty = true;
-	if (surface->frame_pending) {
+	for (int i = 0; i < 2; i++) {
+		surface->damage[i].full = true;
+		surface->damage[i].rects.size = 0;
+	}
+	schedule_frame(surface);
+}
+
+/* Whether one of @rects already contains the given rectangle */
+static bool
+covered(struct wl_array *rects, int x, int y, int width, int height)
+{
+	cairo_rectangle_int_t *rect;
+	wl_array_for_each(rect, rects) {
+		if (x >= rect->x && y >= rect->y
+				&& x + width <= rect->x + rect->width
+				&& y + height <= rect->y + rect->height) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void
+surface_damage_rect(struct surface *surface, int x, int y, int width,
+		int height)
+{
+	if (!surface_is_configured(surface) || width <= 0 || height <= 0) {
 		return;
 	}
-	struct wl_callback *callback = wl_surface_frame(surface->surface);
-	wl_callback_add_listener(callback, &surface_frame_listener, surface);
-	surface->frame_pending = true;
-	wl_surface_commit(surface->surface);
+	for (int i = 0; i < 2; i++) {
+		struct wl_array *rects = &surface->damage[i].rects;
+		if (surface->damage[i].full || covered(rects, x, y, width,
+				height)) {
+			continue;
+		}
+		if (rects->size / sizeof(cairo_rectangle_int_t)
+				>= SURFACE_MAX_DAMAGE_RECTS) {
+			surface->damage[i].full = true;
+			rects->size = 0;
+			continue;
+		}
+		cairo_rectangle_int_t *rect = wl_array_add(rects, sizeof(*rect));
+		if (!rect) {
+			surface->damage[i].full = true;
+			continue;
+		}
+		*rect = (cairo_rectangle_int_t){ x, y, width, height };
+	}
+	schedule_frame(surface);
 }
 
 void
-surface_destroy(struct surface *surface)
+surface_unmap(struct surface *surface)
 {
+	if (surface->frame) {
+		wl_callback_destroy(surface->frame);
+		surface->frame = NULL;
+	}
 	if (surface->layer_surface) {
 		zwlr_layer_surface_v1_destroy(surface->layer_surface);
+		surface->layer_surface = NULL;
 	}
 	if (surface->surface) {
 		wl_surface_destroy(surface->surface);
+		surface->surface = NULL;
+	}
+
+	/*
+	 * The buffers are as big as the output, so they are dropped rather than
+	 * kept for a menu which is hidden most of the time
+	 */
+	for (int i = 0; i < 2; i++) {
+		destroy_buffer(&surface->buffers[i]);
+		wl_array_release(&surface->damage[i].rects);
+		wl_array_init(&surface->damage[i].rects);
+	}
+
+	/* Not configured, so nothing is drawn until mapped again */
+	surface->width = 0;
+	surface->height = 0;
+	surface->dirty = false;
+
+	/* Have the next one configured by the time the menu is shown again */
+	if (surface->output) {
+		surface_prepare(surface->output);
 	}
-	destroy_buffer(&surface->buffers[0]);
-	destroy_buffer(&surface->buffers[1]);
+}
+
+void
+surface_destroy(struct surface *surface)
+{
+	surface->output = NULL;
+	surface_unmap(surface);
 	free(surface);
 }
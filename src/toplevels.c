@@ -0,0 +1,280 @@
+// SPDX-License-Identifier: GPL-2.0-only
+#define _POSIX_C_SOURCE 200809L
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sway-client-helpers/log.h>
+#include <wayland-client.h>
+#include "menu.h"
+#include "toplevels.h"
+#include "trappist.h"
+#include "wlr-foreign-toplevel-management-unstable-v1-client-protocol.h"
+
+/*
+ * A window, as announced by the compositor. Windows get an item once their
+ * first done event has come, which points back at them.
+ */
+struct toplevel {
+	struct zwlr_foreign_toplevel_handle_v1 *handle;
+	char *title;
+	char *app_id;
+	bool title_changed;
+	bool app_id_changed;
+	bool listed;
+	struct menuitem *item; /* in the window list, if there is one */
+	struct wl_list link; /* toplevels */
+};
+
+static struct wl_list toplevels = { &toplevels, &toplevels };
+
+/* Items are freed with their menus, as on reload */
+static int
+item_destructor(struct menuitem *item)
+{
+	if (item->toplevel && item->toplevel->item == item) {
+		item->toplevel->item = NULL;
+	}
+	return 0;
+}
+
+/* Strings of window items are allocated on the item, to go with it */
+static void
+set_label(struct menuitem *item, struct toplevel *toplevel)
+{
+	const char *label = toplevel->title && *toplevel->title
+		? toplevel->title : toplevel->app_id;
+	talloc_free(item->label);
+	item->label = talloc_strdup(item, label ? label : "");
+}
+
+/* The icon is named after the app id, and resolved when rendered */
+static void
+set_icon(struct menuitem *item, struct toplevel *toplevel)
+{
+	talloc_free(item->icon);
+	talloc_free(item->icon_name);
+	item->icon = talloc_strdup(item, toplevel->app_id);
+	item->icon_name = NULL;
+}
+
+static void
+add_item(struct menu *menu, struct toplevel *toplevel)
+{
+	struct menuitem *item = item_create(menu, NULL);
+	if (!item) {
+		return;
+	}
+	set_label(item, toplevel);
+	set_icon(item, toplevel);
+	item->toplevel = toplevel;
+	toplevel->item = item;
+	talloc_set_destructor(item, item_destructor);
+}
+
+static void
+handle_title(void *data, struct zwlr_foreign_toplevel_handle_v1 *handle,
+		const char *title)
+{
+	struct toplevel *toplevel = data;
+	if (toplevel->title && !strcmp(toplevel->title, title)) {
+		return;
+	}
+	free(toplevel->title);
+	toplevel->title = strdup(title);
+	toplevel->title_changed = true;
+}
+
+static void
+handle_app_id(void *data, struct zwlr_foreign_toplevel_handle_v1 *handle,
+		const char *app_id)
+{
+	struct toplevel *toplevel = data;
+	if (toplevel->app_id && !strcmp(toplevel->app_id, app_id)) {
+		return;
+	}
+	free(toplevel->app_id);
+	toplevel->app_id = strdup(app_id);
+	toplevel->app_id_changed = true;
+}
+
+static void
+handle_output_enter(void *data, struct zwlr_foreign_toplevel_handle_v1 *handle,
+		struct wl_output *output)
+{
+	/* nop */
+}
+
+static void
+handle_output_leave(void *data, struct zwlr_foreign_toplevel_handle_v1 *handle,
+		struct wl_output *output)
+{
+	/* nop */
+}
+
+static void
+handle_state(void *data, struct zwlr_foreign_toplevel_handle_v1 *handle,
+		struct wl_array *state)
+{
+	/* nop */
+}
+
+/* Changes are applied as a whole once done, so each is drawn only once */
+static void
+handle_done(void *data, struct zwlr_foreign_toplevel_handle_v1 *handle)
+{
+	struct toplevel *toplevel = data;
+	struct menu *menu = get_menu_by_id(TOPLEVELS_MENU_ID);
+	if (!toplevel->listed) {
+		/* Keep listed windows first, in the order they were listed */
+		toplevel->listed = true;
+		wl_list_remove(&toplevel->link);
+		wl_list_insert(toplevels.prev, &toplevel->link);
+		if (menu) {
+			add_item(menu, toplevel);
+			menu_items_added(menu);
+		}
+	} else if (toplevel->title_changed || toplevel->app_id_changed) {
+		struct menuitem *item = toplevel->item;
+		if (item) {
+			set_label(item, toplevel);
+			if (toplevel->app_id_changed) {
+				set_icon(item, toplevel);
+			}
+			menu_item_changed(item);
+		}
+	}
+	toplevel->title_changed = false;
+	toplevel->app_id_changed = false;
+}
+
+static void
+toplevel_destroy(struct toplevel *toplevel)
+{
+	if (toplevel->item) {
+		toplevel->item->toplevel = NULL;
+	}
+	wl_list_remove(&toplevel->link);
+	zwlr_foreign_toplevel_handle_v1_destroy(toplevel->handle);
+	free(toplevel->title);
+	free(toplevel->app_id);
+	free(toplevel);
+}
+
+static void
+handle_closed(void *data, struct zwlr_foreign_toplevel_handle_v1 *handle)
+{
+	struct toplevel *toplevel = data;
+	if (toplevel->item) {
+		menu_item_destroy(toplevel->item);
+	}
+	toplevel_destroy(toplevel);
+}
+
+static void
+handle_parent(void *data, struct zwlr_foreign_toplevel_handle_v1 *handle,
+		struct zwlr_foreign_toplevel_handle_v1 *parent)
+{
+	/* nop */
+}
+
+static const struct zwlr_foreign_toplevel_handle_v1_listener toplevel_listener = {
+	.title = handle_title,
+	.app_id = handle_app_id,
+	.output_enter = handle_output_enter,
+	.output_leave = handle_output_leave,
+	.state = handle_state,
+	.done = handle_done,
+	.closed = handle_closed,
+	.parent = handle_parent,
+};
+
+static void
+handle_toplevel(void *data, struct zwlr_foreign_toplevel_manager_v1 *manager,
+		struct zwlr_foreign_toplevel_handle_v1 *handle)
+{
+	struct toplevel *toplevel = calloc(1, sizeof(*toplevel));
+	if (!toplevel) {
+		zwlr_foreign_toplevel_handle_v1_destroy(handle);
+		return;
+	}
+	toplevel->handle = handle;
+	wl_list_insert(toplevels.prev, &toplevel->link);
+	zwlr_foreign_toplevel_handle_v1_add_listener(handle, &toplevel_listener,
+		toplevel);
+}
+
+static void
+handle_finished(void *data, struct zwlr_foreign_toplevel_manager_v1 *manager)
+{
+	struct state *state = data;
+	zwlr_foreign_toplevel_manager_v1_destroy(manager);
+	state->toplevel_manager = NULL;
+}
+
+static const struct zwlr_foreign_toplevel_manager_v1_listener manager_listener = {
+	.toplevel = handle_toplevel,
+	.finished = handle_finished,
+};
+
+void
+toplevels_init(struct state *state, struct wl_registry *registry,
+		uint32_t name, uint32_t version)
+{
+	state->toplevel_manager = wl_registry_bind(registry, name,
+		&zwlr_foreign_toplevel_manager_v1_interface,
+		version < 3 ? version : 3);
+	zwlr_foreign_toplevel_manager_v1_add_listener(state->toplevel_manager,
+		&manager_listener, state);
+}
+
+struct menu *
+toplevels_menu_create(const char *id)
+{
+	return menu_create(id, "Windows", NULL);
+}
+
+void
+toplevels_menu_fill(struct menu *menu)
+{
+	struct toplevel *toplevel;
+	wl_list_for_each(toplevel, &toplevels, link) {
+		if (toplevel->listed) {
+			add_item(menu, toplevel);
+		}
+	}
+}
+
+void
+toplevels_menu_relink(struct menu *menu)
+{
+	for (int i = 0; i < menu->nr_items; i++) {
+		struct menuitem *item = menu->items[i];
+		if (item->toplevel) {
+			item->toplevel->item = item;
+		}
+	}
+}
+
+void
+toplevels_activate(struct state *state, struct menuitem *item)
+{
+	if (!state->seat->wl_seat || !item->toplevel) {
+		return;
+	}
+	zwlr_foreign_toplevel_handle_v1_activate(item->toplevel->handle,
+		state->seat->wl_seat);
+	wl_display_flush(state->display);
+}
+
+void
+toplevels_finish(struct state *state)
+{
+	struct toplevel *toplevel, *tmp;
+	wl_list_for_each_safe(toplevel, tmp, &toplevels, link) {
+		toplevel_destroy(toplevel);
+	}
+	if (state->toplevel_manager) {
+		zwlr_foreign_toplevel_manager_v1_stop(state->toplevel_manager);
+		state->toplevel_manager = NULL;
+	}
+}
@@ -0,0 +1,307 @@
+// SPDX-License-Identifier: GPL-2.0-only
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <glib.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sway-client-helpers/log.h>
+#include <sway-client-helpers/loop.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <wayland-util.h>
+#include "watch.h"
+
+/* Time to wait for writes to settle before reporting a change */
+#define WATCH_SETTLE_DELAY (100)
+
+#define WATCH_DIR_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM \
+	| IN_CREATE | IN_DELETE)
+
+struct watched_dir {
+	int wd;
+	char *path;
+};
+
+struct watch {
+	struct loop *loop;
+	int fd;
+	struct loop_timer *timer;
+	void *data;
+
+	/* watch_file() */
+	char *dir;
+	char *name;
+	void (*callback)(void *data);
+
+	/*
+	 * watch_dirs(): the watched directories, and the paths changed since
+	 * the last call of @dirs_callback, or NULL if events were lost
+	 */
+	struct wl_array dirs; /* struct watched_dir */
+	GHashTable *changed;
+	bool overflow;
+	void (*dirs_callback)(const char **paths, size_t nr_paths, void *data);
+};
+
+static void
+handle_timer(void *data)
+{
+	struct watch *watch = data;
+	watch->timer = NULL;
+	if (watch->callback) {
+		watch->callback(watch->data);
+		return;
+	}
+
+	GHashTable *changed = watch->changed;
+	bool overflow = watch->overflow;
+	watch->changed = g_hash_table_new_full(g_str_hash, g_str_equal,
+		g_free, NULL);
+	watch->overflow = false;
+	if (overflow) {
+		watch->dirs_callback(NULL, 0, watch->data);
+	} else {
+		guint nr_paths;
+		const char **paths = (const char **)
+			g_hash_table_get_keys_as_array(changed, &nr_paths);
+		watch->dirs_callback(paths, nr_paths, watch->data);
+		g_free(paths);
+	}
+	g_hash_table_destroy(changed);
+}
+
+static const char *
+dir_path(struct watch *watch, int wd)
+{
+	struct watched_dir *dir;
+	wl_array_for_each(dir, &watch->dirs) {
+		if (dir->wd == wd) {
+			return dir->path;
+		}
+	}
+	return NULL;
+}
+
+static void
+forget_dir(struct watch *watch, int wd)
+{
+	struct watched_dir *dirs = watch->dirs.data;
+	size_t n = watch->dirs.size / sizeof(*dirs);
+	for (size_t i = 0; i < n; i++) {
+		if (dirs[i].wd == wd) {
+			free(dirs[i].path);
+			dirs[i] = dirs[n - 1];
+			watch->dirs.size -= sizeof(*dirs);
+			return;
+		}
+	}
+}
+
+/*
+ * Watch @path and its subdirectories. Files found in directories which
+ * appeared while watching are reported as changed, as no events will come
+ * for them.
+ */
+static void
+add_dir(struct watch *watch, const char *path, bool report)
+{
+	int wd = inotify_add_watch(watch->fd, path,
+		WATCH_DIR_EVENTS | IN_ONLYDIR);
+	if (wd < 0) {
+		if (errno != ENOENT && errno != ENOTDIR) {
+			LOG_ERRNO(LOG_ERROR, "cannot watch '%s'", path);
+		}
+		return;
+	}
+	if (!dir_path(watch, wd)) {
+		struct watched_dir *dir = wl_array_add(&watch->dirs,
+			sizeof(*dir));
+		dir->wd = wd;
+		dir->path = strdup(path);
+	}
+
+	DIR *d = opendir(path);
+	if (!d) {
+		return;
+	}
+	struct dirent *entry;
+	while ((entry = readdir(d))) {
+		if (entry->d_name[0] == '.') {
+			continue;
+		}
+		char *child = g_build_filename(path, entry->d_name, NULL);
+		struct stat st;
+		bool is_dir = entry->d_type == DT_DIR
+			|| (entry->d_type == DT_UNKNOWN && !lstat(child, &st)
+				&& S_ISDIR(st.st_mode));
+		if (is_dir) {
+			add_dir(watch, child, report);
+		} else if (report) {
+			g_hash_table_add(watch->changed, g_strdup(child));
+		}
+		g_free(child);
+	}
+	closedir(d);
+}
+
+static bool
+handle_dir_event(struct watch *watch, const struct inotify_event *event)
+{
+	if (event->mask & IN_Q_OVERFLOW) {
+		watch->overflow = true;
+		return true;
+	}
+	if (event->mask & IN_IGNORED) {
+		forget_dir(watch, event->wd);
+		return false;
+	}
+	const char *dir = dir_path(watch, event->wd);
+	if (!dir || !event->len) {
+		return false;
+	}
+	char *path = g_build_filename(dir, event->name, NULL);
+	if ((event->mask & IN_ISDIR)
+			&& (event->mask & (IN_CREATE | IN_MOVED_TO))) {
+		add_dir(watch, path, true);
+	}
+	g_hash_table_add(watch->changed, path);
+	return true;
+}
+
+static void
+handle_events(int fd, short mask, void *data)
+{
+	struct watch *watch = data;
+	char buf[4096]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	bool changed = false;
+
+	for (;;) {
+		ssize_t len = read(fd, buf, sizeof(buf));
+		if (len <= 0) {
+			if (len < 0 && errno != EAGAIN) {
+				LOG_ERRNO(LOG_ERROR, "cannot read inotify events");
+			}
+			break;
+		}
+		const struct inotify_event *event;
+		for (char *p = buf; p < buf + len; p += sizeof(*event) + event->len) {
+			event = (const struct inotify_event *)p;
+			if (watch->dirs_callback) {
+				changed |= handle_dir_event(watch, event);
+			} else if (event->len && !strcmp(event->name, watch->name)) {
+				changed = true;
+			}
+		}
+	}
+	if (!changed) {
+		return;
+	}
+	if (watch->timer) {
+		loop_remove_timer(watch->loop, watch->timer);
+	}
+	watch->timer = loop_add_timer(watch->loop, WATCH_SETTLE_DELAY,
+		handle_timer, watch);
+}
+
+struct watch *
+watch_file(struct loop *loop, const char *path,
+		void (*callback)(void *data), void *data)
+{
+	struct watch *watch = calloc(1, sizeof(*watch));
+	if (!watch) {
+		return NULL;
+	}
+	watch->loop = loop;
+	watch->callback = callback;
+	watch->data = data;
+	wl_array_init(&watch->dirs);
+	watch->dir = strdup(path);
+	char *slash = strrchr(watch->dir, '/');
+	if (slash) {
+		*slash = '\0';
+		watch->name = strdup(slash + 1);
+	} else {
+		watch->name = watch->dir;
+		watch->dir = strdup(".");
+	}
+
+	watch->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (watch->fd < 0) {
+		LOG_ERRNO(LOG_ERROR, "cannot initialize inotify");
+		goto err;
+	}
+	const char *dir = *watch->dir ? watch->dir : "/";
+	if (inotify_add_watch(watch->fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+		LOG_ERRNO(LOG_ERROR, "cannot watch '%s'", dir);
+		close(watch->fd);
+		goto err;
+	}
+	loop_add_fd(loop, watch->fd, POLLIN, handle_events, watch);
+	return watch;
+err:
+	free(watch->dir);
+	free(watch->name);
+	free(watch);
+	return NULL;
+}
+
+struct watch *
+watch_dirs(struct loop *loop,
+		void (*callback)(const char **paths, size_t nr_paths, void *data),
+		void *data)
+{
+	struct watch *watch = calloc(1, sizeof(*watch));
+	if (!watch) {
+		return NULL;
+	}
+	watch->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (watch->fd < 0) {
+		LOG_ERRNO(LOG_ERROR, "cannot initialize inotify");
+		free(watch);
+		return NULL;
+	}
+	watch->loop = loop;
+	watch->dirs_callback = callback;
+	watch->data = data;
+	wl_array_init(&watch->dirs);
+	watch->changed = g_hash_table_new_full(g_str_hash, g_str_equal,
+		g_free, NULL);
+	loop_add_fd(loop, watch->fd, POLLIN, handle_events, watch);
+	return watch;
+}
+
+void
+watch_add_dir(struct watch *watch, const char *path)
+{
+	add_dir(watch, path, false);
+}
+
+void
+watch_destroy(struct watch *watch)
+{
+	if (!watch) {
+		return;
+	}
+	if (watch->timer) {
+		loop_remove_timer(watch->loop, watch->timer);
+	}
+	loop_remove_fd(watch->loop, watch->fd);
+	close(watch->fd);
+	struct watched_dir *dir;
+	wl_array_for_each(dir, &watch->dirs) {
+		free(dir->path);
+	}
+	wl_array_release(&watch->dirs);
+	if (watch->changed) {
+		g_hash_table_destroy(watch->changed);
+	}
+	free(watch->dir);
+	free(watch->name);
+	free(watch);
+}
@@ -38,6 +38,7 @@
 struct loop_fd_event {
 	void (*callback)(int fd, short mask, void *data);
 	void *data;
+	bool removed;
 	struct wl_list link; // struct loop_fd_event::link
 };
 
@@ -56,6 +57,9 @@ struct loop {
 
 	struct wl_list fd_events; // struct loop_fd_event::link
 	struct wl_list timers; // struct loop_timer::link
+
+	// fds removed while dispatching are only marked, and purged afterwards
+	bool dispatching;
 };
 
 struct loop *loop_create(void) {
@@ -113,19 +117,34 @@ void loop_poll(struct loop *loop) {
 
 	// Dispatch fds
 	size_t fd_index = 0;
-	struct loop_fd_event *event = NULL;
+	struct loop_fd_event *event = NULL, *tmp_event = NULL;
+	loop->dispatching = true;
 	wl_list_for_each(event, &loop->fd_events, link) {
 		struct pollfd pfd = loop->fds[fd_index];
 
 		// Always send these events
 		unsigned events = pfd.events | POLLHUP | POLLERR;
 
-		if (pfd.revents & events) {
+		if (!event->removed && (pfd.revents & events)) {
 			event->callback(pfd.fd, pfd.revents, event->data);
 		}
 
 		++fd_index;
 	}
+	loop->dispatching = false;
+
+	fd_index = 0;
+	wl_list_for_each_safe(event, tmp_event, &loop->fd_events, link) {
+		if (!event->removed) {
+			++fd_index;
+			continue;
+		}
+		wl_list_remove(&event->link);
+		free(event);
+		loop->fd_length--;
+		memmove(&loop->fds[fd_index], &loop->fds[fd_index + 1],
+				sizeof(struct pollfd) * (loop->fd_length - fd_index));
+	}
 
 	// Dispatch timers
 	if (!wl_list_empty(&loop->timers)) {
@@ -202,7 +221,13 @@ bool loop_remove_fd(struct loop *loop, int fd) {
 	size_t fd_index = 0;
 	struct loop_fd_event *event = NULL, *tmp_event = NULL;
 	wl_list_for_each_safe(event, tmp_event, &loop->fd_events, link) {
-		if (loop->fds[fd_index].fd == fd) {
+		if (!event->removed && loop->fds[fd_index].fd == fd) {
+			if (loop->dispatching) {
+				// Keep the list and fds in step until dispatch is over
+				event->removed = true;
+				loop->fds[fd_index].fd = -1;
+				return true;
+			}
 			wl_list_remove(&event->link);
 			free(event);
 
@@ -0,0 +1,105 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * The menu cache is saved again while trappist runs, after pipemenus may have
+ * been opened. Their output must not come back as items of the menu file when
+ * the cache is loaded.
+ */
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <talloc.h>
+#include "cache.h"
+#include "conf.h"
+#include "menu.h"
+#include "parse.h"
+
+#define CHECK(condition) do { \
+	if (!(condition)) { \
+		fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, \
+			#condition); \
+		exit(EXIT_FAILURE); \
+	} \
+} while (0)
+
+static const char menu_xml[] =
+	"<openbox_menu>\n"
+	"<menu id=\"root-menu\" label=\"\">\n"
+	"  <item label=\"Terminal\"><action name=\"Execute\" command=\"foot\"/>"
+	"</item>\n"
+	"  <menu id=\"pipe\" label=\"Pipe\" execute=\"true\"/>\n"
+	"</menu>\n"
+	"</openbox_menu>\n";
+
+static const char pipemenu_output[] =
+	"<openbox_pipe_menu>\n"
+	"<item label=\"Fetched\"/>\n"
+	"<menu id=\"fetched-menu\" label=\"Fetched menu\">\n"
+	"  <item label=\"Nested\"/>\n"
+	"</menu>\n"
+	"</openbox_pipe_menu>\n";
+
+static char dir[] = "/tmp/trappist-test-XXXXXX";
+
+static int
+remove_entry(const char *path, const struct stat *st, int flag,
+		struct FTW *ftw)
+{
+	return remove(path);
+}
+
+static void
+remove_dir(void)
+{
+	nftw(dir, remove_entry, 8, FTW_DEPTH | FTW_PHYS);
+}
+
+/* Fill @menu from its command's output, as pipemenu.c does */
+static bool
+fetch(struct menu *menu)
+{
+	menu->content = talloc_new(NULL);
+	menu_alloc_from(menu->content);
+	struct stream *stream = parse_stream_create(menu);
+	bool ok = stream && parse_stream_feed(stream, pipemenu_output,
+		strlen(pipemenu_output)) && parse_stream_finish(stream);
+	menu_alloc_from(NULL);
+	menu->fetched = 1;
+	return ok;
+}
+
+int
+main(void)
+{
+	CHECK(mkdtemp(dir));
+	atexit(remove_dir);
+	setenv("XDG_CACHE_HOME", dir, 1);
+	char menu_file[sizeof(dir) + 16];
+	snprintf(menu_file, sizeof(menu_file), "%s/menu.xml", dir);
+	FILE *fp = fopen(menu_file, "w");
+	CHECK(fp && fputs(menu_xml, fp) >= 0 && !fclose(fp));
+
+	TALLOC_CTX *ctx = talloc_new(NULL);
+	struct conf conf = { 0 };
+	arena_init(ctx);
+	CHECK(parse_file(menu_file));
+	struct menu *pipe = get_menu_by_id("pipe");
+	CHECK(pipe && pipe->execute);
+	CHECK(fetch(pipe));
+	CHECK(pipe->nr_items == 2);
+	cache_save(menu_file, &conf);
+	menu_finish(NULL);
+
+	arena_init(ctx);
+	CHECK(cache_load(menu_file, &conf));
+	struct menu *root = get_menu_by_id("root-menu");
+	CHECK(root && root->nr_items == 2);
+	pipe = get_menu_by_id("pipe");
+	CHECK(pipe && pipe->execute && !strcmp(pipe->execute, "true"));
+	CHECK(pipe->nr_items == 0);
+	CHECK(!get_menu_by_id("fetched-menu"));
+	menu_finish(NULL);
+
+	talloc_free(ctx);
+	return 0;
+}